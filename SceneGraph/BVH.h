@@ -0,0 +1,234 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "Bounds.h"
+
+//Dynamic bounding volume hierarchy over boxes, every leaf carries a value (e.g. the slot of an object).
+//Leaves are inserted next to the sibling that grows the tree the least and store their box enlarged by a margin:
+//a box that moves inside it only costs a check, one that leaves it is removed and inserted again, so the tree is
+//rebuilt a leaf at a time and never as a whole. Queries only descend into the nodes whose box passes the test
+class BVH {
+public:
+    static constexpr uint32_t none = UINT32_MAX;
+
+private:
+    struct Node {
+        Bounds bounds;
+        uint32_t parent{none};
+        //A leaf has no children
+        uint32_t left{none};
+        uint32_t right{none};
+        uint32_t value{0};
+
+        bool leaf() const {
+            return left == none;
+        }
+    };
+
+    std::vector<Node> mNodes;
+    std::vector<uint32_t> mFreeNodes;
+    uint32_t mRoot{none};
+
+    //Fraction of its size a leaf box is enlarged by
+    float mMargin;
+
+public:
+
+    explicit BVH(const float margin = 0.1f) : mMargin(margin) {
+    }
+
+    //Returns the leaf, valid until it is removed
+    uint32_t insert(const Bounds& bounds, const uint32_t value) {
+        const uint32_t leaf = allocate();
+        mNodes[leaf].bounds = {bounds.center, bounds.extents * (1.0f + mMargin)};
+        mNodes[leaf].value = value;
+        insertLeaf(leaf);
+        return leaf;
+    }
+
+    void remove(const uint32_t leaf) {
+        removeLeaf(leaf);
+        release(leaf);
+    }
+
+    //Move a leaf to new bounds, returns whether it left its enlarged box and had to be inserted again
+    bool update(const uint32_t leaf, const Bounds& bounds) {
+        if (mNodes[leaf].bounds.contains(bounds)) {
+            return false;
+        }
+        removeLeaf(leaf);
+        mNodes[leaf].bounds = {bounds.center, bounds.extents * (1.0f + mMargin)};
+        insertLeaf(leaf);
+        return true;
+    }
+
+    void setValue(const uint32_t leaf, const uint32_t value) {
+        mNodes[leaf].value = value;
+    }
+
+    //visit(value) for every leaf whose box intersects the frustum
+    template<typename Visit>
+    void query(const Frustum& frustum, Visit&& visit) const {
+        traverse([&](const Bounds& bounds) { return frustum.intersects(bounds); },
+                 [&](const Node& node) { visit(node.value); });
+    }
+
+    //visit(value) for every leaf whose box intersects the sphere
+    template<typename Visit>
+    void query(const glm::vec3& center, const float radius, Visit&& visit) const {
+        traverse([&](const Bounds& bounds) { return bounds.intersects(center, radius); },
+                 [&](const Node& node) { visit(node.value); });
+    }
+
+    //visit(value, distance) for every leaf whose box the ray origin + t * direction hits with t <= maxDistance,
+    //distance is the t where the ray enters the box. The leaves are not visited in order
+    template<typename Visit>
+    void raycast(const glm::vec3& origin, const glm::vec3& direction, const float maxDistance, Visit&& visit) const {
+        const glm::vec3 inverseDirection = 1.0f / direction;
+        float distance;
+        traverse([&](const Bounds& bounds) { return bounds.intersects(origin, inverseDirection, maxDistance, distance); },
+                 [&](const Node& node) { visit(node.value, distance); });
+    }
+
+    bool empty() const {
+        return mRoot == none;
+    }
+
+private:
+
+    //Depth first over the nodes passing test, leaf is called on the leaves right after they passed it
+    template<typename Test, typename Leaf>
+    void traverse(Test&& test, Leaf&& leaf) const {
+        if (mRoot == none) {
+            return;
+        }
+        thread_local std::vector<uint32_t> stack;
+        stack.clear();
+        stack.push_back(mRoot);
+        while (!stack.empty()) {
+            const Node& node = mNodes[stack.back()];
+            stack.pop_back();
+            if (!test(node.bounds)) {
+                continue;
+            }
+            if (node.leaf()) {
+                leaf(node);
+            } else {
+                stack.push_back(node.left);
+                stack.push_back(node.right);
+            }
+        }
+    }
+
+    uint32_t allocate() {
+        if (mFreeNodes.empty()) {
+            mNodes.emplace_back();
+            return mNodes.size() - 1;
+        }
+        const uint32_t index = mFreeNodes.back();
+        mFreeNodes.pop_back();
+        mNodes[index] = Node{};
+        return index;
+    }
+
+    void release(const uint32_t index) {
+        mFreeNodes.push_back(index);
+    }
+
+    //Walking down, the cost of every choice is the area the new box adds: the children of the current node only
+    //pay for their own growth, every ancestor grows by the same amount whichever child is taken
+    uint32_t findSibling(const Bounds& bounds) const {
+        uint32_t index = mRoot;
+        while (!mNodes[index].leaf()) {
+            const Node& node = mNodes[index];
+            const float area = node.bounds.area();
+            const float combined = Bounds::merge(node.bounds, bounds).area();
+
+            //Making a new parent of this node and the leaf
+            const float cost = 2.0f * combined;
+            //Growth of this node when the leaf goes further down
+            const float inherited = 2.0f * (combined - area);
+
+            const auto descend = [&](const uint32_t child) {
+                const Bounds& childBounds = mNodes[child].bounds;
+                const float merged = Bounds::merge(childBounds, bounds).area();
+                return (mNodes[child].leaf() ? merged : merged - childBounds.area()) + inherited;
+            };
+            const float leftCost = descend(node.left);
+            const float rightCost = descend(node.right);
+
+            if (cost < leftCost && cost < rightCost) {
+                break;
+            }
+            index = leftCost < rightCost ? node.left : node.right;
+        }
+        return index;
+    }
+
+    void insertLeaf(const uint32_t leaf) {
+        if (mRoot == none) {
+            mRoot = leaf;
+            mNodes[leaf].parent = none;
+            return;
+        }
+
+        const uint32_t sibling = findSibling(mNodes[leaf].bounds);
+        const uint32_t oldParent = mNodes[sibling].parent;
+        const uint32_t newParent = allocate();
+        mNodes[newParent].parent = oldParent;
+        mNodes[newParent].bounds = Bounds::merge(mNodes[sibling].bounds, mNodes[leaf].bounds);
+        mNodes[newParent].left = sibling;
+        mNodes[newParent].right = leaf;
+        mNodes[sibling].parent = newParent;
+        mNodes[leaf].parent = newParent;
+
+        if (oldParent == none) {
+            mRoot = newParent;
+        } else {
+            if (mNodes[oldParent].left == sibling) {
+                mNodes[oldParent].left = newParent;
+            } else {
+                mNodes[oldParent].right = newParent;
+            }
+            refit(oldParent);
+        }
+    }
+
+    //The parent of the leaf goes away, the sibling takes its place
+    void removeLeaf(const uint32_t leaf) {
+        if (leaf == mRoot) {
+            mRoot = none;
+            return;
+        }
+
+        const uint32_t parent = mNodes[leaf].parent;
+        const uint32_t grandParent = mNodes[parent].parent;
+        const uint32_t sibling = mNodes[parent].left == leaf ? mNodes[parent].right : mNodes[parent].left;
+
+        mNodes[sibling].parent = grandParent;
+        if (grandParent == none) {
+            mRoot = sibling;
+        } else {
+            if (mNodes[grandParent].left == parent) {
+                mNodes[grandParent].left = sibling;
+            } else {
+                mNodes[grandParent].right = sibling;
+            }
+            refit(grandParent);
+        }
+        release(parent);
+        mNodes[leaf].parent = none;
+    }
+
+    //Recompute the boxes from index up to the root
+    void refit(uint32_t index) {
+        while (index != none) {
+            Node& node = mNodes[index];
+            node.bounds = Bounds::merge(mNodes[node.left].bounds, mNodes[node.right].bounds);
+            index = node.parent;
+        }
+    }
+};
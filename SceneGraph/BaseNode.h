@@ -7,115 +7,173 @@
 #include <glm/glm.hpp>
 #include <string>
 #include <vector>
-#include <list>
+#include <span>
 #include <glm/ext/matrix_transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <iostream>
 #include "Visitor.h"
 #include "Material.h"
 #include "Geometry.h"
+#include "TransformStore.h"
 
-class BaseNode {
-protected:
-
-    glm::mat4 mModel;
-    glm::mat4 mModelInverse;
-
-    glm::mat4 mScale;
-    glm::mat4 mScaleInverse;
-    glm::mat4 mTranslate;
-    glm::mat4 mTranslateInverse;
-    glm::mat4 mRotate;
-    glm::mat4 mRotateInverse;
+//Told when a node enters or leaves a scene, through the add/remove hooks of the nodes,
+//and when a node of the scene is moved or an object gets a new material
+class SceneListener {
+public:
+    virtual void nodeAttached(BaseNode* node) = 0;
+    virtual void nodeDetached(BaseNode* node) = 0;
+    virtual void transformChanged(BaseNode* node) = 0;
+    virtual void materialChanged(ObjectNode* node) = 0;
+};
 
+class BaseNode {
 private:
     std::string mName;
 
-    const BaseNode* mParent = nullptr;
-    std::list<std::shared_ptr<BaseNode>> mChildren;
+    //Listener of the scene the node is part of, inherited from the parent when the node is added
+    SceneListener* mListener = nullptr;
 
-    bool mToUpdate = true;
+    BaseNode* mParent = nullptr;
+    std::vector<std::shared_ptr<BaseNode>> mChildren;
+
+    //Entry of the node in the transform store, the matrices live there and not in the node
+    TransformStore::Handle mTransform;
 
     //Scene graph changes events
-    virtual void nodeAdded(const BaseNode* to){
+    virtual void nodeAdded(BaseNode* to){
         mParent = to;
-        transformUpdated();
+        transforms().setParent(mTransform, to->mTransform);
+        if (to->mListener != nullptr) {
+            attach(to->mListener);
+        }
     }
-    virtual void nodeRemoved(const BaseNode* parent){
+    virtual void nodeRemoved(BaseNode* parent){
         mParent = nullptr;
+        transforms().setParent(mTransform, TransformStore::none);
+        detach();
+    }
+
+    void attach(SceneListener* listener) {
+        mListener = listener;
+        listener->nodeAttached(this);
+        for (const auto& child : mChildren) {
+            child->attach(listener);
+        }
+    }
+    void detach() {
+        if (mListener == nullptr) {
+            return;
+        }
+        mListener->nodeDetached(this);
+        mListener = nullptr;
+        for (const auto& child : mChildren) {
+            child->detach();
+        }
     }
 
 protected:
+    //Every node of every graph shares one store, so that the update is a single pass over contiguous arrays
+    static TransformStore& transforms() {
+        static TransformStore store;
+        return store;
+    }
+
+    //Only marks the node, the matrices are computed by the next updateTransforms
     void transformUpdated(){
-        if(mParent == nullptr) {
-            mModel = (mRotate * mScale * mTranslate);
-            mModelInverse = (mTranslateInverse * mScaleInverse * mRotateInverse);
-        }else{
-            mModel = mParent->mModel * (mRotate * mScale * mTranslate);
-            mModelInverse = (mTranslateInverse * mScaleInverse * mRotateInverse) * mParent->mModelInverse;
+        transforms().markDirty(mTransform);
+        if (mListener != nullptr) {
+            mListener->transformChanged(this);
         }
+    }
 
-        for(auto child : mChildren){
-            child->transformUpdated();
-        }
+    SceneListener* sceneListener() const {
+        return mListener;
     }
 
+    glm::mat4 modelInverseMatrix() const {
+        return transforms().worldInverse(mTransform);
+    }
 
 public:
 
-    BaseNode(const std::string name){
-        mName = name;
-        mModel = mModelInverse = glm::mat4(1.0f);
-        mScale = mScaleInverse = glm::mat4(1.0f);
-        mTranslate = mTranslateInverse = glm::mat4(1.0f);
-        mRotate = mRotateInverse = glm::mat4(1.0f);
+    BaseNode(const std::string name) : mName(name), mTransform(transforms().create()) {
+    }
+    BaseNode(const BaseNode& other) :
+            mName(other.mName),
+            mParent(other.mParent),
+            mChildren(other.mChildren),
+            mTransform(transforms().clone(other.mTransform)) {
+    }
+    BaseNode& operator=(const BaseNode&) = delete;
+
+    virtual ~BaseNode() {
+        detach();
+        transforms().release(mTransform);
+    }
+
+    //Make the node the root of a scene, it and every node added below it are reported to the listener.
+    //The listener has to outlive the nodes attached to it
+    void setSceneListener(SceneListener* listener) {
+        detach();
+        if (listener != nullptr) {
+            attach(listener);
+        }
     }
 
     void addScale(const glm::vec3 vec) {
-        mScale = glm::scale(mScale, vec);
-        mScaleInverse = glm::scale(mScaleInverse, -vec);
+        auto& store = transforms();
+        store.scale(mTransform) = glm::scale(store.scale(mTransform), vec);
+        store.scaleInverse(mTransform) = glm::scale(store.scaleInverse(mTransform), -vec);
         transformUpdated();
     }
     void addTranslation(const glm::vec3 vec) {
-        mTranslate = glm::translate(mTranslate, vec);
-        mTranslateInverse = glm::translate(mTranslateInverse, -vec);
+        auto& store = transforms();
+        store.translate(mTransform) = glm::translate(store.translate(mTransform), vec);
+        store.translateInverse(mTransform) = glm::translate(store.translateInverse(mTransform), -vec);
         transformUpdated();
     }
     void addRotation(const glm::vec3 vec, float radians) {
-        mRotate = glm::rotate(mRotate, radians, vec);
-        mRotateInverse = glm::rotate(mRotateInverse, radians, vec);
+        auto& store = transforms();
+        store.rotate(mTransform) = glm::rotate(store.rotate(mTransform), radians, vec);
+        store.rotateInverse(mTransform) = glm::rotate(store.rotateInverse(mTransform), radians, vec);
         transformUpdated();
     }
 
     void setScale(const glm::vec3 vec) {
-        mScale = glm::scale(glm::mat4(1.0f), vec);
-        mScaleInverse = glm::scale(glm::mat4(1.0f), -vec);
+        auto& store = transforms();
+        store.scale(mTransform) = glm::scale(glm::mat4(1.0f), vec);
+        store.scaleInverse(mTransform) = glm::scale(glm::mat4(1.0f), -vec);
         transformUpdated();
     }
     void setTranslation(const glm::vec3 vec) {
-        mTranslate = glm::translate(glm::mat4(1.0f), vec);
-        mTranslateInverse = glm::translate(glm::mat4(1.0f), -vec);
+        auto& store = transforms();
+        store.translate(mTransform) = glm::translate(glm::mat4(1.0f), vec);
+        store.translateInverse(mTransform) = glm::translate(glm::mat4(1.0f), -vec);
         transformUpdated();
     }
     void setRotation(const glm::vec3 vec, float radians) {
-        mRotate = glm::rotate(glm::mat4(1.0f), radians, vec);
-        mRotateInverse = glm::rotate(glm::mat4(1.0f), radians, vec);
+        auto& store = transforms();
+        store.rotate(mTransform) = glm::rotate(glm::mat4(1.0f), radians, vec);
+        store.rotateInverse(mTransform) = glm::rotate(glm::mat4(1.0f), radians, vec);
         transformUpdated();
     }
 
     void setScale(const glm::mat4 transform) {
-        mScale = transform;
-        mScaleInverse = glm::inverse(transform);
+        auto& store = transforms();
+        store.scale(mTransform) = transform;
+        store.scaleInverse(mTransform) = TransformKernels::inverse(transform);
         transformUpdated();
     }
     void setTranslation(const glm::mat4 transform) {
-        mTranslate = transform;
-        mTranslateInverse = glm::inverse(transform);
+        auto& store = transforms();
+        store.translate(mTransform) = transform;
+        store.translateInverse(mTransform) = TransformKernels::inverse(transform);
         transformUpdated();
     }
     void setRotation(const glm::mat4 transform) {
-        mRotate = transform;
-        mRotateInverse = glm::inverse(transform);
+        auto& store = transforms();
+        store.rotate(mTransform) = transform;
+        store.rotateInverse(mTransform) = TransformKernels::inverse(transform);
         transformUpdated();
     }
 
@@ -133,7 +191,13 @@ public:
         return mName;
     }
 
-    const std::list<std::shared_ptr<BaseNode>> children() const {
+    //nullptr for the root of a scene
+    BaseNode* parent() const {
+        return mParent;
+    }
+
+    //View on the children, iterating it neither copies the list nor touches the reference counts
+    std::span<const std::shared_ptr<BaseNode>> children() const {
         return mChildren;
     }
 
@@ -142,23 +206,28 @@ public:
         node->nodeAdded(this);
     }
     void removeChild(std::shared_ptr<BaseNode> node){
-        mChildren.remove(node);
+        std::erase(mChildren, node);
         node->nodeRemoved(this);
     }
 
-    bool toUpdate() {
-        return mToUpdate;
+    //Changes only when updateTransforms gives the node a different world matrix,
+    //a reader that kept the last version it saw knows whether modelMatrix has to be read again
+    uint32_t transformVersion() const {
+        return transforms().version(mTransform);
     }
-    void setToUpdate() {
-        mToUpdate = true;
-        for(auto child : mChildren) child->setToUpdate();
+
+    //Compute the world matrices of every node changed since the last call, once per frame
+    //and before reading modelMatrix or the view matrices. The store is shared, so this updates every graph
+    void updateTransforms() {
+        transforms().update();
     }
-    void updated() {
-        mToUpdate = false;
+    //Same result, independent subtrees are updated on the workers
+    void updateTransforms(ThreadPool& pool) {
+        transforms().update(pool);
     }
 
     glm::mat4 modelMatrix() const {
-        return mModel;
+        return transforms().world(mTransform);
     }
     virtual void accept(Visitor* v) {
         v->visit(this);
@@ -169,63 +238,54 @@ public:
 class ObjectNode : public BaseNode {
 private:
 
-    Geometry mObjectGeometry;
-    Material mObjectMaterial;
-
-    UniformSet mObjectSet;
+    //Shared with every node using the same assets, never copied
+    std::shared_ptr<const Geometry> mObjectGeometry;
+    std::shared_ptr<const Material> mObjectMaterial;
 
 public:
     ObjectNode(const std::string name,
-            Geometry geometry,
-            Material material) :
+            std::shared_ptr<const Geometry> geometry,
+            std::shared_ptr<const Material> material) :
             BaseNode(name),
             mObjectGeometry(std::move(geometry)),
             mObjectMaterial(std::move(material)){
-        mObjectSet.slot = 0;
-        mObjectSet.uniforms[0] = Uniform{TYPE_BUFFER, {4, 4, 0},
-                                        sizeof(glm::mat4),1,
-                                        std::make_shared<glm::mat4>(1.0)};
-        mObjectSet.uniforms[1] = Uniform{TYPE_BUFFER, {4, 4, 0},
-                                        sizeof(glm::mat4),1,
-                                        std::make_shared<glm::mat4>(1.0)};
-        mObjectSet.uniforms[2] = Uniform{TYPE_BUFFER, {4, 4, 0},
-                                        sizeof(glm::mat4),1,
-                                        std::make_shared<glm::mat4>(1.0)};
-        mObjectSet.uniforms[3] = Uniform{TYPE_BUFFER, {3, 1, 0},
-                                        sizeof(glm::vec3),1,
-                                        std::make_shared<glm::vec3>(1.0)};
     }
 
+    //The object set is shared by every object: the camera (view, projection and position),
+    //the array with the model matrices of all the objects and the slot of every instance drawn
     static std::map<std::string, UniformSet> getObjectSetArchetype(){
         UniformSet objectSetArchetype;
         objectSetArchetype.slot = 0;
         objectSetArchetype.uniforms[0] = Uniform{TYPE_BUFFER, {4, 4, 0},
+                                         sizeof(glm::mat4) * 2 + sizeof(glm::vec4),1,
+                                         nullptr};
+        objectSetArchetype.uniforms[1] = Uniform{TYPE_STORAGE_BUFFER, {4, 4, 0},
                                          sizeof(glm::mat4),1,
-                                         std::make_shared<glm::mat4>(1.0)};
-        objectSetArchetype.uniforms[1] = Uniform{TYPE_BUFFER, {4, 4, 0},
-                                         sizeof(glm::mat4),1,
-                                         std::make_shared<glm::mat4>(1.0)};
-        objectSetArchetype.uniforms[2] = Uniform{TYPE_BUFFER, {4, 4, 0},
-                                         sizeof(glm::mat4),1,
-                                         std::make_shared<glm::mat4>(1.0)};
-        objectSetArchetype.uniforms[3] = Uniform{TYPE_BUFFER, {3, 1, 0},
-                                         sizeof(glm::vec3),1,
-                                         std::make_shared<glm::vec3>(1.0)};
+                                         nullptr};
+        objectSetArchetype.uniforms[2] = Uniform{TYPE_STORAGE_BUFFER, {1, 1, 0},
+                                         sizeof(uint32_t),1,
+                                         nullptr};
         return {{"object", objectSetArchetype},
                 {"material", Material::getMaterialSetArchetype()}};
     }
 
-    Geometry getGeometry() const {
+    const std::shared_ptr<const Geometry>& getGeometry() const {
         return mObjectGeometry;
     }
 
-    Material getMaterial() const {
+    const std::shared_ptr<const Material>& getMaterial() const {
         return mObjectMaterial;
     }
 
+    void setMaterial(std::shared_ptr<const Material> material) {
+        mObjectMaterial = std::move(material);
+        if (sceneListener() != nullptr) {
+            sceneListener()->materialChanged(this);
+        }
+    }
+
     std::map<std::string, UniformSet> getUniformSets() const {
-        return {{"object", mObjectSet},
-                {"material", mObjectMaterial.uniforms()}};
+        return {{"material", *mObjectMaterial->uniforms()}};
     }
 
     void accept(Visitor* v) override {
@@ -257,7 +317,7 @@ public:
     }
 
     glm::mat4 getViewMatrix() const {
-        return mModelInverse;
+        return modelInverseMatrix();
     }
     glm::mat4 getProjectionMatrix() const {
         return mProjection;
@@ -284,7 +344,7 @@ public:
 
 
     glm::mat4 getViewMatrix() const {
-        return mModelInverse;
+        return modelInverseMatrix();
     }
     glm::mat4 getProjectionMatrix() const {
         return mProjection;
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BOUNDS_SSE
+#endif
+
+//Axis aligned box, kept as center and half size so that moving and testing it needs no corners
+struct Bounds {
+    glm::vec3 center{0.0f};
+    glm::vec3 extents{0.0f};
+
+    static Bounds fromMinMax(const glm::vec3& min, const glm::vec3& max) {
+        return {(min + max) * 0.5f, (max - min) * 0.5f};
+    }
+
+    glm::vec3 min() const {
+        return center - extents;
+    }
+    glm::vec3 max() const {
+        return center + extents;
+    }
+
+    //Radius of the bounding sphere around the same center
+    float radius() const {
+        return glm::length(extents);
+    }
+
+    //Proportional to the surface area, the cost of a box in a bounding volume hierarchy
+    float area() const {
+        return extents.x * extents.y + extents.y * extents.z + extents.z * extents.x;
+    }
+
+    static Bounds merge(const Bounds& a, const Bounds& b) {
+        return fromMinMax(glm::min(a.min(), b.min()), glm::max(a.max(), b.max()));
+    }
+
+    bool contains(const Bounds& other) const {
+        const glm::vec3 d = glm::abs(other.center - center) + other.extents;
+        return d.x <= extents.x && d.y <= extents.y && d.z <= extents.z;
+    }
+
+    bool intersects(const glm::vec3& sphereCenter, const float sphereRadius) const {
+        const glm::vec3 d = glm::max(glm::abs(sphereCenter - center) - extents, glm::vec3(0.0f));
+        return glm::dot(d, d) <= sphereRadius * sphereRadius;
+    }
+
+    //Slab test of the ray origin + t * direction, inverseDirection is 1 / direction. On a hit distance is the t
+    //where the ray enters the box, 0 when it starts inside
+    bool intersects(const glm::vec3& origin, const glm::vec3& inverseDirection, const float maxDistance, float& distance) const {
+        const glm::vec3 t0 = (min() - origin) * inverseDirection;
+        const glm::vec3 t1 = (max() - origin) * inverseDirection;
+        const glm::vec3 entries = glm::min(t0, t1);
+        const glm::vec3 exits = glm::max(t0, t1);
+        const float enter = std::max(std::max(entries.x, entries.y), std::max(entries.z, 0.0f));
+        const float exit = std::min(std::min(exits.x, exits.y), std::min(exits.z, maxDistance));
+        distance = enter;
+        return enter <= exit;
+    }
+
+    //Box containing this one moved by an affine matrix, the half size along every axis is the sum of the
+    //absolute contributions of the three axes of the matrix
+    Bounds transformed(const glm::mat4& m) const {
+        const glm::vec3 c(m * glm::vec4(center, 1.0f));
+        const glm::vec3 e = glm::abs(glm::vec3(m[0])) * extents.x +
+                            glm::abs(glm::vec3(m[1])) * extents.y +
+                            glm::abs(glm::vec3(m[2])) * extents.z;
+        return {c, e};
+    }
+};
+
+//The six planes of a view volume, normals pointing inside and normalized, so that the plane equation is a distance
+class Frustum {
+private:
+    //By component, plane i is x[i] * px + y[i] * py + z[i] * pz + w[i]. Two copies of the first plane
+    //fill the last register, the test does 4 planes at a time
+    alignas(16) float mX[8];
+    alignas(16) float mY[8];
+    alignas(16) float mZ[8];
+    alignas(16) float mW[8];
+    //Absolute values of the normals, they scale the half size of a box along the plane normal
+    alignas(16) float mAbsX[8];
+    alignas(16) float mAbsY[8];
+    alignas(16) float mAbsZ[8];
+
+public:
+
+    //Planes of projection * view, the clip volume is -w <= x, y <= w and -w <= z <= w. For a zero to one depth
+    //range the near plane used is looser than the real one, so nothing visible is ever dropped
+    explicit Frustum(const glm::mat4& viewProjection) {
+        const glm::mat4& m = viewProjection;
+        const glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+        const glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+        const glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+        const glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+        const glm::vec4 planes[8] = {
+                row3 + row0, row3 - row0,
+                row3 + row1, row3 - row1,
+                row3 + row2, row3 - row2,
+                row3 + row0, row3 + row0
+        };
+        for (uint32_t i = 0; i < 8; ++i) {
+            const glm::vec4 plane = planes[i] / glm::length(glm::vec3(planes[i]));
+            mX[i] = plane.x;
+            mY[i] = plane.y;
+            mZ[i] = plane.z;
+            mW[i] = plane.w;
+            mAbsX[i] = std::abs(plane.x);
+            mAbsY[i] = std::abs(plane.y);
+            mAbsZ[i] = std::abs(plane.z);
+        }
+    }
+
+    //False only when the box is entirely behind one of the planes
+    bool intersects(const Bounds& bounds) const {
+#if defined(BOUNDS_SSE)
+        const __m128 cx = _mm_set1_ps(bounds.center.x);
+        const __m128 cy = _mm_set1_ps(bounds.center.y);
+        const __m128 cz = _mm_set1_ps(bounds.center.z);
+        const __m128 ex = _mm_set1_ps(bounds.extents.x);
+        const __m128 ey = _mm_set1_ps(bounds.extents.y);
+        const __m128 ez = _mm_set1_ps(bounds.extents.z);
+        for (uint32_t i = 0; i < 8; i += 4) {
+            const __m128 distance = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(_mm_load_ps(mX + i), cx), _mm_mul_ps(_mm_load_ps(mY + i), cy)),
+                    _mm_add_ps(_mm_mul_ps(_mm_load_ps(mZ + i), cz), _mm_load_ps(mW + i)));
+            const __m128 reach = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(_mm_load_ps(mAbsX + i), ex), _mm_mul_ps(_mm_load_ps(mAbsY + i), ey)),
+                    _mm_mul_ps(_mm_load_ps(mAbsZ + i), ez));
+            if (_mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(distance, reach), _mm_setzero_ps())) != 0) {
+                return false;
+            }
+        }
+        return true;
+#else
+        for (uint32_t i = 0; i < 6; ++i) {
+            const float distance = mX[i] * bounds.center.x + mY[i] * bounds.center.y + mZ[i] * bounds.center.z + mW[i];
+            const float reach = mAbsX[i] * bounds.extents.x + mAbsY[i] * bounds.extents.y + mAbsZ[i] * bounds.extents.z;
+            if (distance + reach < 0.0f) {
+                return false;
+            }
+        }
+        return true;
+#endif
+    }
+
+    //False only when the sphere is entirely behind one of the planes
+    bool intersects(const glm::vec3& center, const float radius) const {
+        for (uint32_t i = 0; i < 6; ++i) {
+            if (mX[i] * center.x + mY[i] * center.y + mZ[i] * center.z + mW[i] < -radius) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //visible[i] is set to whether bounds[i] intersects the frustum, returns how many do
+    uint32_t test(const Bounds* bounds, const uint32_t count, uint8_t* visible) const {
+        uint32_t nOfVisible = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            visible[i] = intersects(bounds[i]);
+            nOfVisible += visible[i];
+        }
+        return nOfVisible;
+    }
+};
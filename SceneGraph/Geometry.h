@@ -6,8 +6,14 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <functional>
+#include <cstring>
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "../libs/tinyobjloader/tiny_obj_loader.h"
+#include "Hash.h"
+#include "Bounds.h"
+#include "Residency.h"
 
 struct matrices {
     glm::mat4 model;
@@ -23,25 +29,97 @@ struct VertexData {
     glm::vec2 texcoord_2{0.0, 0.0};
 };
 
+//Indices and vertices of a geometry
+struct GeometryData {
+    std::vector<uint32_t> indices;
+    std::vector<VertexData> vertices;
+};
+
+//Immutable once built, nodes and the renderer share it through std::shared_ptr<const Geometry>,
+//so the vertex data exists once however many objects use it. The data itself sits behind a ResidentData handle,
+//through which the renderer frees it after the upload when the residency allows it
 class Geometry {
 private:
 
-    std::vector<uint32_t> mIndices;
-    std::vector<VertexData> mVertexData;
+    std::shared_ptr<ResidentData<GeometryData>> mData;
+
+    //Derived from the content, computed once
+    uint64_t mHash;
+    Bounds mBounds;
+    size_t mIndexCount;
+    size_t mVertexCount;
 
 public:
 
-    Geometry(std::vector<uint32_t> indices, std::vector<VertexData> vertex_data) :
-        mIndices(indices),
-        mVertexData(vertex_data) {
+    Geometry(std::vector<uint32_t> indices,
+             std::vector<VertexData> vertex_data,
+             const Residency residency = Residency::Keep,
+             std::function<GeometryData()> source = {}) :
+        mIndexCount(indices.size()),
+        mVertexCount(vertex_data.size()) {
+        mHash = hashBytes(indices.data(), indices.size() * sizeof(uint32_t));
+        mHash = hashBytes(vertex_data.data(), vertex_data.size() * sizeof(VertexData), mHash);
+        mBounds = computeBounds(vertex_data);
+        mData = std::make_shared<ResidentData<GeometryData>>(GeometryData{std::move(indices), std::move(vertex_data)});
+        mData->setResidency(residency, std::move(source));
+    }
+
+    //Keep the returned pointer while reading, the data may be released by the renderer meanwhile
+    std::shared_ptr<const GeometryData> data() const {
+        return mData->get();
+    }
+
+    //Handle to the data, shared by the copies of the geometry
+    const std::shared_ptr<ResidentData<GeometryData>>& resident() const {
+        return mData;
+    }
+
+    //Size of the data in memory
+    size_t byteSize() const {
+        return mIndexCount * sizeof(uint32_t) + mVertexCount * sizeof(VertexData);
+    }
+
+    //Box around every vertex, in the space of the geometry
+    const Bounds& bounds() const {
+        return mBounds;
+    }
+
+    //Equal for geometries with the same content, the renderer uploads them once
+    uint64_t hash() const {
+        return mHash;
     }
 
-    const std::vector<uint32_t>& indices() const {
-        return mIndices;
+    //Whether other holds the same indices and vertices, for geometries with the same hash. Copies share their data,
+    //others are compared byte by byte: released data cannot be compared and never matches
+    bool sameContent(const Geometry& other) const {
+        if (mData == other.mData) {
+            return true;
+        }
+        if (mIndexCount != other.mIndexCount || mVertexCount != other.mVertexCount) {
+            return false;
+        }
+        const auto data = mData->peek();
+        const auto otherData = other.mData->peek();
+        if (!data || !otherData) {
+            return false;
+        }
+        return std::memcmp(data->indices.data(), otherData->indices.data(), mIndexCount * sizeof(uint32_t)) == 0 &&
+               std::memcmp(data->vertices.data(), otherData->vertices.data(), mVertexCount * sizeof(VertexData)) == 0;
     }
 
-    const std::vector<VertexData>& vertices() const {
-        return mVertexData;
+private:
+
+    static Bounds computeBounds(const std::vector<VertexData>& vertices) {
+        if (vertices.empty()) {
+            return {};
+        }
+        glm::vec3 min = vertices[0].position;
+        glm::vec3 max = vertices[0].position;
+        for (const auto& vertex : vertices) {
+            min = glm::min(min, vertex.position);
+            max = glm::max(max, vertex.position);
+        }
+        return Bounds::fromMinMax(min, max);
     }
 
-};
\ No newline at end of file
+};
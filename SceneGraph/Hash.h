@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+//FNV-1a, pass the previous result as hash to combine several ranges
+inline uint64_t hashBytes(const void* data, const size_t size, uint64_t hash = 14695981039346656037ull) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+template<typename T>
+inline uint64_t hashValue(const T& value, const uint64_t hash = 14695981039346656037ull) {
+    return hashBytes(&value, sizeof(T), hash);
+}
@@ -6,74 +6,169 @@
 
 #include <string>
 #include <map>
+#include <array>
+#include <memory>
+#include <functional>
+#include <stdexcept>
 #include <fstream>
 #include "Texture.h"
+#include "Hash.h"
+#include "Residency.h"
 #include "../Vulkan/Resources.h"
 
+//SPIR-V bytes, shared by every material built from the same shader
+using ShaderCode = std::shared_ptr<const std::vector<char>>;
+
+//Built and filled in place, then handed to the nodes as std::shared_ptr<const Material> and never changed again
 class Material {
 private:
     std::string m_name;
 
-    const std::vector<char> m_vertex_shader;
-    const std::vector<char> m_fragment_shader;
+    ShaderCode m_vertex_shader;
+    ShaderCode m_fragment_shader;
 
-    //Material input data
-    UniformSet set;
+    //Material input data, behind a handle through which the renderer frees it after the upload when the
+    //residency allows it. Copies of the material share the handle until one of them is changed
+    std::shared_ptr<ResidentData<UniformSet>> m_set;
 
 public:
 
     Material(const std::string name,
-            const std::vector<char> vertex_shader,
-            const std::vector<char> fragment_shader) :
+            ShaderCode vertex_shader,
+            ShaderCode fragment_shader) :
                 m_name(name),
-                m_vertex_shader(vertex_shader),
-                m_fragment_shader(fragment_shader){
-        set = getMaterialSetArchetype();
+                m_vertex_shader(std::move(vertex_shader)),
+                m_fragment_shader(std::move(fragment_shader)),
+                m_set(std::make_shared<ResidentData<UniformSet>>(getMaterialSetArchetype())){
+    }
+    Material(const std::string name,
+            std::vector<char> vertex_shader,
+            std::vector<char> fragment_shader) :
+                Material(name,
+                         std::make_shared<const std::vector<char>>(std::move(vertex_shader)),
+                         std::make_shared<const std::vector<char>>(std::move(fragment_shader))){
     }
 
-    std::vector<char> getVertexShader() const {
-        return m_vertex_shader;
+    const std::vector<char>& getVertexShader() const {
+        return *m_vertex_shader;
     }
 
-    std::vector<char> getFragmentShader() const {
-        return m_fragment_shader;
+    const std::vector<char>& getFragmentShader() const {
+        return *m_fragment_shader;
     }
 
+    //Every slot starts with a 1x1 default image: white albedo, flat normal, white specular (full specular and
+    //roughness) and black emission. The pixels are made once and shared by every material not overriding them
     static UniformSet getMaterialSetArchetype(){
-        UniformSet materialSetArchetype;
-        materialSetArchetype.slot = 1;
-        std::shared_ptr<unsigned char> albedoDataPtr(new unsigned char[1024 * 1024 * 4]);
-        std::shared_ptr<unsigned char> normalDataPtr(new unsigned char[1024 * 1024 * 4]);
-        std::shared_ptr<unsigned char> specularDataPtr(new unsigned char[1024 * 1024 * 4]);
-        std::shared_ptr<unsigned char> emissiveDataPtr(new unsigned char[1024 * 1024 * 4]);
-
-        materialSetArchetype.uniforms[0] = Uniform{.type = TYPE_IMAGE, .size = {1024, 1024, 0},
-                .byte_size = 1024 * 1024 * 4, .count = 1,
-                .data = albedoDataPtr
-        };
-        materialSetArchetype.uniforms[1] = Uniform{.type = TYPE_IMAGE, .size = {1024, 1024, 0},
-                .byte_size = 1024 * 1024 * 4, .count = 1,
-                .data = normalDataPtr
-        };
-        materialSetArchetype.uniforms[2] = Uniform{.type = TYPE_IMAGE, .size = {1024, 1024, 0},
-                .byte_size = 1024 * 1024 * 4, .count = 1,
-                .data = specularDataPtr
-        };
-        materialSetArchetype.uniforms[3] = Uniform{.type = TYPE_IMAGE, .size = {1024, 1024, 0},
-                .byte_size = 1024 * 1024 * 4, .count = 1,
-                .data = emissiveDataPtr
-        };
-
+        static const UniformSet materialSetArchetype = [] {
+            UniformSet archetype;
+            archetype.slot = 1;
+            archetype.uniforms[0] = defaultImage(whitePixel());
+            archetype.uniforms[1] = defaultImage(flatNormalPixel());
+            archetype.uniforms[2] = defaultImage(whitePixel());
+            archetype.uniforms[3] = defaultImage(blackPixel());
+            return archetype;
+        }();
         return materialSetArchetype;
     }
 
+    //Whether the uniform still holds one of the shared default images
+    static bool isDefaultImage(const Uniform& uniform) {
+        return uniform.type == TYPE_IMAGE &&
+               (uniform.data == whitePixel() || uniform.data == flatNormalPixel() || uniform.data == blackPixel());
+    }
+
     Uniform& uniform(uint32_t location){
-        return set.uniforms[location];
+        return ownSet().edit().uniforms[location];
+    }
+
+    //Keep the returned pointer while reading, the data may be released by the renderer meanwhile
+    std::shared_ptr<const UniformSet> uniforms() const {
+        return m_set->get();
+    }
+
+    void setResidency(const Residency residency, std::function<UniformSet()> source = {}) {
+        ownSet().setResidency(residency, std::move(source));
+    }
+
+    Residency residency() const {
+        return m_set->residency();
+    }
+
+    //Handle to the uniforms, shared by the copies of the material
+    const std::shared_ptr<ResidentData<UniformSet>>& resident() const {
+        return m_set;
     }
 
-    UniformSet uniforms() const {
-        return set;
+    //Bytes of image data the material holds, 0 once released. The shared defaults are not counted
+    size_t imageByteSize() const {
+        const auto set = m_set->peek();
+        if (!set) {
+            return 0;
+        }
+        size_t bytes = 0;
+        for (const auto& [location, uniform] : set->uniforms) {
+            if (uniform.type == TYPE_IMAGE && uniform.data && !isDefaultImage(uniform)) {
+                bytes += uniform.byte_size;
+            }
+        }
+        return bytes;
     }
 
+    //Equal for copies of a material, the renderer creates their pipeline and set once. The shaders are compared
+    //by content, the uniforms by identity: copies share them until one is changed, separately built ones do not
+    uint64_t hash() const {
+        uint64_t hash = hashBytes(m_name.data(), m_name.size());
+        hash = hashBytes(m_vertex_shader->data(), m_vertex_shader->size(), hash);
+        hash = hashBytes(m_fragment_shader->data(), m_fragment_shader->size(), hash);
+        return hashValue(m_set.get(), hash);
+    }
+
+    //Whether other is a copy of this material, for materials with the same hash: the uniforms compared by identity
+    //as in hash, the name and the shaders by content
+    bool sameContent(const Material& other) const {
+        return m_set == other.m_set && m_name == other.m_name &&
+               sameShader(m_vertex_shader, other.m_vertex_shader) &&
+               sameShader(m_fragment_shader, other.m_fragment_shader);
+    }
+
+private:
+
+    static std::shared_ptr<void> makePixel(const unsigned char r, const unsigned char g,
+                                           const unsigned char b, const unsigned char a) {
+        return std::make_shared<std::array<unsigned char, 4>>(std::array<unsigned char, 4>{r, g, b, a});
+    }
+    static const std::shared_ptr<void>& whitePixel() {
+        static const std::shared_ptr<void> pixel = makePixel(255, 255, 255, 255);
+        return pixel;
+    }
+    //The normal (0, 0, 1) in tangent space, encoded as n * 0.5 + 0.5
+    static const std::shared_ptr<void>& flatNormalPixel() {
+        static const std::shared_ptr<void> pixel = makePixel(128, 128, 255, 255);
+        return pixel;
+    }
+    static const std::shared_ptr<void>& blackPixel() {
+        static const std::shared_ptr<void> pixel = makePixel(0, 0, 0, 255);
+        return pixel;
+    }
+
+    static Uniform defaultImage(std::shared_ptr<void> pixel) {
+        return Uniform{.type = TYPE_IMAGE, .size = {1, 1, 0},
+                .byte_size = 4, .count = 1,
+                .data = std::move(pixel)
+        };
+    }
+
+    static bool sameShader(const ShaderCode& a, const ShaderCode& b) {
+        return a == b || *a == *b;
+    }
+
+    //The uniforms of this material only, copied from the ones shared with other copies before a change
+    ResidentData<UniformSet>& ownSet() {
+        if (m_set.use_count() > 1) {
+            m_set = std::make_shared<ResidentData<UniformSet>>(*m_set);
+        }
+        return *m_set;
+    }
 
 };
\ No newline at end of file
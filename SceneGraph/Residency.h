@@ -0,0 +1,92 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <stdexcept>
+
+//What happens to the CPU copy of an asset once the renderer uploaded it
+enum class Residency {
+    //The copy stays, the asset can be uploaded again at any time
+    Keep,
+    //The copy is freed after the upload, the asset cannot be uploaded again
+    DropAfterUpload,
+    //The copy is freed after the upload and rebuilt from the source of the asset when it is read again
+    Reload
+};
+
+//CPU copy of the data of an asset. The asset is immutable and shared as const, it only holds a std::shared_ptr to
+//this handle: releasing and reloading the data goes through the handle, under its lock. A reader gets its own
+//reference to the data, what it reads stays valid until it is done even if the handle releases it meanwhile
+template<typename T>
+class ResidentData {
+private:
+    mutable std::mutex mMutex;
+    std::shared_ptr<T> mData;
+    Residency mResidency{Residency::Keep};
+    //Builds the same data again, for Residency::Reload
+    std::function<T()> mSource;
+
+public:
+
+    explicit ResidentData(T data) : mData(std::make_shared<T>(std::move(data))) {
+    }
+
+    ResidentData(const ResidentData& other) {
+        std::lock_guard lock(other.mMutex);
+        mData = other.mData ? std::make_shared<T>(*other.mData) : nullptr;
+        mResidency = other.mResidency;
+        mSource = other.mSource;
+    }
+
+    void setResidency(const Residency residency, std::function<T()> source = {}) {
+        if (residency == Residency::Reload && !source) {
+            throw std::runtime_error("Data reloaded on demand needs a source");
+        }
+        std::lock_guard lock(mMutex);
+        mResidency = residency;
+        mSource = std::move(source);
+    }
+
+    Residency residency() const {
+        std::lock_guard lock(mMutex);
+        return mResidency;
+    }
+
+    //The data, rebuilt from the source if it was released. Throws if it was released for good
+    std::shared_ptr<const T> get() {
+        std::lock_guard lock(mMutex);
+        if (!mData) {
+            if (mResidency != Residency::Reload) {
+                throw std::runtime_error("Asset data was released after the upload");
+            }
+            mData = std::make_shared<T>(mSource());
+        }
+        return mData;
+    }
+
+    //The data if it is in memory, nullptr otherwise. Never reloads it
+    std::shared_ptr<const T> peek() const {
+        std::lock_guard lock(mMutex);
+        return mData;
+    }
+
+    //The data to change while the asset is built, before anything else reads it
+    T& edit() {
+        std::lock_guard lock(mMutex);
+        if (!mData) {
+            throw std::runtime_error("Asset data was released after the upload");
+        }
+        return *mData;
+    }
+
+    //Let go of the data if the residency allows it, returns whether it did. It is freed with its last reader
+    bool release() {
+        std::lock_guard lock(mMutex);
+        if (mResidency == Residency::Keep || !mData) {
+            return false;
+        }
+        mData.reset();
+        return true;
+    }
+};
@@ -4,7 +4,9 @@
 
 #pragma once
 
+#include <vector>
 #include "Visitor.h"
+#include "BaseNode.h"
 
 class CollectObjectsVisitor : public Visitor {
 private:
@@ -65,4 +67,57 @@ public:
     const CameraNode* collected() const {
         return activeCamera;
     }
-};
\ No newline at end of file
+};
+
+//Objects, lights and the active camera in a single walk of the tree
+class CollectSceneVisitor : public Visitor {
+private:
+    std::vector<ObjectNode*> objects;
+    std::vector<LightNode*> lights;
+    const CameraNode* activeCamera = nullptr;
+
+public:
+    CollectSceneVisitor() = default;
+
+    void visit(BaseNode* node){};
+    void visit(ObjectNode* node) override {
+        objects.push_back(node);
+    }
+    void visit(LightNode* node) override {
+        lights.push_back(node);
+    };
+    void visit(CameraNode* node) override {
+        if(node->isActive()){
+            activeCamera = node;
+        }
+    };
+
+    const std::vector<ObjectNode*>& collectedObjects() const {
+        return objects;
+    }
+    const std::vector<LightNode*>& collectedLights() const {
+        return lights;
+    }
+    const CameraNode* collectedCamera() const {
+        return activeCamera;
+    }
+};
+
+//Depth first, parents before children and children in order. The stack is kept between walks so that a walk
+//does not allocate, a visitor can start a walk of its own since each walk only pops what it pushed
+inline void visitTree(BaseNode* root, Visitor* visitor) {
+    static thread_local std::vector<BaseNode*> stack;
+    const size_t base = stack.size();
+
+    stack.push_back(root);
+    while (stack.size() > base) {
+        BaseNode* node = stack.back();
+        stack.pop_back();
+        node->accept(visitor);
+
+        const auto children = node->children();
+        for (auto child = children.rbegin(); child != children.rend(); ++child) {
+            stack.push_back(child->get());
+        }
+    }
+}
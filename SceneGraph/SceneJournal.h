@@ -0,0 +1,118 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_set>
+#include <unordered_map>
+#include <cstdint>
+
+class BaseNode;
+
+enum class SceneEventType {
+    ObjectAdded,
+    //Only the name is set, the node can be gone by the time the event is read
+    ObjectRemoved,
+    //Local transform of the node set, the world matrices of its whole subtree changed
+    TransformChanged,
+    MaterialChanged,
+    LightsChanged,
+    CameraChanged
+};
+
+//The node of ObjectAdded and MaterialChanged events is an ObjectNode
+struct SceneEvent {
+    SceneEventType type;
+    BaseNode* node;
+    std::string name;
+    //The node left the scene after the event, it must be skipped
+    bool forgotten{false};
+};
+
+//Ordered list of the changes of a scene since it was last read. Repeated changes of the same kind to the same node
+//are recorded once, and the events of a node removed before the journal is read are marked forgotten
+class SceneJournal {
+private:
+    std::vector<SceneEvent> mEvents;
+    //Indices of the events of every node, so that forgetting a node only touches its own events
+    std::unordered_map<const BaseNode*, std::vector<uint32_t>> mEventsOfNode;
+    uint32_t mForgotten{0};
+
+    //Nodes with a transform or material event already in the journal
+    std::unordered_set<const BaseNode*> mMoved;
+    std::unordered_set<const BaseNode*> mRestyled;
+    bool mLightsChanged{false};
+    bool mCameraChanged{false};
+
+public:
+
+    void objectAdded(BaseNode* node, const std::string& name) {
+        record({SceneEventType::ObjectAdded, node, name});
+    }
+
+    void objectRemoved(const std::string& name) {
+        mEvents.push_back({SceneEventType::ObjectRemoved, nullptr, name});
+    }
+
+    void transformChanged(BaseNode* node) {
+        if (mMoved.insert(node).second) {
+            record({SceneEventType::TransformChanged, node, {}});
+        }
+    }
+
+    void materialChanged(BaseNode* node) {
+        if (mRestyled.insert(node).second) {
+            record({SceneEventType::MaterialChanged, node, {}});
+        }
+    }
+
+    void lightsChanged() {
+        if (!mLightsChanged) {
+            mLightsChanged = true;
+            mEvents.push_back({SceneEventType::LightsChanged, nullptr, {}});
+        }
+    }
+
+    void cameraChanged() {
+        if (!mCameraChanged) {
+            mCameraChanged = true;
+            mEvents.push_back({SceneEventType::CameraChanged, nullptr, {}});
+        }
+    }
+
+    //The node is about to leave the scene, nothing may point to it anymore. Costs the number of its own events
+    void forget(const BaseNode* node) {
+        mMoved.erase(node);
+        mRestyled.erase(node);
+        const auto found = mEventsOfNode.find(node);
+        if (found == mEventsOfNode.end()) {
+            return;
+        }
+        for (const auto index : found->second) {
+            mEvents[index].node = nullptr;
+            mEvents[index].forgotten = true;
+        }
+        mForgotten += found->second.size();
+        mEventsOfNode.erase(found);
+    }
+
+    //Whether the journal has a transform event for the node
+    bool moved(const BaseNode* node) const {
+        return mMoved.contains(node);
+    }
+
+    bool empty() const {
+        return mEvents.size() == mForgotten;
+    }
+
+    //In order, the forgotten events included
+    const std::vector<SceneEvent>& events() const {
+        return mEvents;
+    }
+
+private:
+
+    void record(SceneEvent event) {
+        mEventsOfNode[event.node].push_back(mEvents.size());
+        mEvents.push_back(std::move(event));
+    }
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include "BaseNode.h"
+#include "Visitor.h"
+#include "SceneJournal.h"
+
+//Typed lists of the nodes of a scene, kept up to date by the add/remove hooks of the nodes.
+//Reading them costs nothing, a node is dispatched on its type once when it enters the scene.
+//Every change reported by the nodes is also recorded in a journal, read once per frame by the renderer
+class SceneRegistry : public SceneListener, private Visitor {
+private:
+
+    //Nodes of one type, added and removed in constant time
+    template<typename T>
+    class NodeList {
+        std::vector<T*> mNodes;
+        std::unordered_map<const BaseNode*, uint32_t> mIndex;
+
+    public:
+        void add(T* node) {
+            if (mIndex.try_emplace(node, mNodes.size()).second) {
+                mNodes.push_back(node);
+            }
+        }
+        bool remove(const BaseNode* node) {
+            auto found = mIndex.find(node);
+            if (found == mIndex.end()) {
+                return false;
+            }
+            const uint32_t index = found->second;
+            mIndex.erase(found);
+            if (index != mNodes.size() - 1) {
+                mNodes[index] = mNodes.back();
+                mIndex[mNodes[index]] = index;
+            }
+            mNodes.pop_back();
+            return true;
+        }
+        const std::vector<T*>& all() const {
+            return mNodes;
+        }
+    };
+
+    NodeList<ObjectNode> mObjects;
+    NodeList<LightNode> mLights;
+    NodeList<CameraNode> mCameras;
+
+    SceneJournal mJournal;
+
+    void visit(BaseNode* node) override {}
+    void visit(ObjectNode* node) override {
+        mObjects.add(node);
+        mJournal.objectAdded(node, node->name());
+    }
+    void visit(LightNode* node) override {
+        mLights.add(node);
+        mJournal.lightsChanged();
+    }
+    void visit(CameraNode* node) override {
+        mCameras.add(node);
+        mJournal.cameraChanged();
+    }
+
+public:
+
+    void nodeAttached(BaseNode* node) override {
+        node->accept(this);
+    }
+
+    void nodeDetached(BaseNode* node) override {
+        //The node may not live until the journal is read
+        mJournal.forget(node);
+        if (mObjects.remove(node)) {
+            mJournal.objectRemoved(node->name());
+        } else if (mLights.remove(node)) {
+            mJournal.lightsChanged();
+        } else if (mCameras.remove(node)) {
+            mJournal.cameraChanged();
+        }
+    }
+
+    void transformChanged(BaseNode* node) override {
+        mJournal.transformChanged(node);
+    }
+
+    void materialChanged(ObjectNode* node) override {
+        mJournal.materialChanged(node);
+    }
+
+    const std::vector<ObjectNode*>& objects() const {
+        return mObjects.all();
+    }
+    const std::vector<LightNode*>& lights() const {
+        return mLights.all();
+    }
+    const std::vector<CameraNode*>& cameras() const {
+        return mCameras.all();
+    }
+    const CameraNode* activeCamera() const {
+        for (const auto camera : mCameras.all()) {
+            if (camera->isActive()) {
+                return camera;
+            }
+        }
+        return nullptr;
+    }
+
+    //Changes since the last call, in the order they happened
+    SceneJournal takeJournal() {
+        SceneJournal journal = std::move(mJournal);
+        mJournal = SceneJournal{};
+        return journal;
+    }
+};
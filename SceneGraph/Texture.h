@@ -8,29 +8,44 @@
 #include <glm/vec2.hpp>
 #include <stdexcept>
 #include <memory>
+#include <cstdlib>
 
+//Filters and wraps of a texture, with the GL values used by glTF. Linear and repeating by default
 struct Sampler{
-    int minFilter;
-    int magFilter;
-    int wrapS;
-    int wrapT;
+    static constexpr int NEAREST = 9728;
+    static constexpr int LINEAR = 9729;
+    static constexpr int NEAREST_MIPMAP_NEAREST = 9984;
+    static constexpr int LINEAR_MIPMAP_NEAREST = 9985;
+    static constexpr int NEAREST_MIPMAP_LINEAR = 9986;
+    static constexpr int LINEAR_MIPMAP_LINEAR = 9987;
+
+    static constexpr int CLAMP_TO_EDGE = 33071;
+    static constexpr int MIRRORED_REPEAT = 33648;
+    static constexpr int REPEAT = 10497;
+
+    int minFilter{LINEAR};
+    int magFilter{LINEAR};
+    int wrapS{REPEAT};
+    int wrapT{REPEAT};
 };
 
 class Texture2D {
 private:
 
-    glm::ivec2 m_image_size;
-    int m_image_channels;
+    glm::ivec2 m_image_size{0, 0};
+    int m_image_channels{0};
 
     std::shared_ptr<unsigned char> m_image_data;
 
 public:
 
     Texture2D() = default;
+    //Takes ownership of pixels allocated with malloc, as stb_image returns them. Copies of the texture
+    //and the uniforms made from it share the pixels
     Texture2D(glm::ivec2 size, int channels, unsigned char* data) :
         m_image_size(size),
         m_image_channels(channels),
-        m_image_data(data){}
+        m_image_data(data, std::free){}
 
     std::shared_ptr<void> data() const {
         return m_image_data;
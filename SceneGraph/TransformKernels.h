@@ -0,0 +1,243 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define TRANSFORM_KERNELS_AVX
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TRANSFORM_KERNELS_SSE
+#endif
+
+//Matrix products and inverses used by the transform update. glm::mat4 is 16 contiguous floats, column major,
+//so a column is one SSE register and two columns are one AVX register. Without SSE the scalar glm path is used
+class TransformKernels {
+public:
+
+#if defined(TRANSFORM_KERNELS_AVX)
+    //Matrices composed together by composeBatch, one per lane
+    static constexpr uint32_t batchWidth = 8;
+#elif defined(TRANSFORM_KERNELS_SSE)
+    static constexpr uint32_t batchWidth = 4;
+#else
+    static constexpr uint32_t batchWidth = 1;
+#endif
+
+    //out = a * b, out can be a or b
+    static void multiply(const glm::mat4& a, const glm::mat4& b, glm::mat4& out) {
+#if defined(TRANSFORM_KERNELS_AVX)
+        const float* pa = &a[0][0];
+        const float* pb = &b[0][0];
+        float* po = &out[0][0];
+
+        //Every column of a in both halves of a register
+        const __m256 a0 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(pa));
+        const __m256 a1 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(pa + 4));
+        const __m256 a2 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(pa + 8));
+        const __m256 a3 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(pa + 12));
+
+        //Two columns of b at a time, element k of each column replicated in its half
+        const __m256 b01 = _mm256_loadu_ps(pb);
+        const __m256 b23 = _mm256_loadu_ps(pb + 8);
+        _mm256_storeu_ps(po, combine(a0, a1, a2, a3, b01));
+        _mm256_storeu_ps(po + 8, combine(a0, a1, a2, a3, b23));
+#elif defined(TRANSFORM_KERNELS_SSE)
+        const float* pa = &a[0][0];
+        const float* pb = &b[0][0];
+        float* po = &out[0][0];
+
+        const __m128 a0 = _mm_loadu_ps(pa);
+        const __m128 a1 = _mm_loadu_ps(pa + 4);
+        const __m128 a2 = _mm_loadu_ps(pa + 8);
+        const __m128 a3 = _mm_loadu_ps(pa + 12);
+
+        __m128 columns[4];
+        for (uint32_t j = 0; j < 4; ++j) {
+            const __m128 column = _mm_loadu_ps(pb + 4 * j);
+            columns[j] = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(a0, _mm_shuffle_ps(column, column, _MM_SHUFFLE(0, 0, 0, 0))),
+                               _mm_mul_ps(a1, _mm_shuffle_ps(column, column, _MM_SHUFFLE(1, 1, 1, 1)))),
+                    _mm_add_ps(_mm_mul_ps(a2, _mm_shuffle_ps(column, column, _MM_SHUFFLE(2, 2, 2, 2))),
+                               _mm_mul_ps(a3, _mm_shuffle_ps(column, column, _MM_SHUFFLE(3, 3, 3, 3)))));
+        }
+        for (uint32_t j = 0; j < 4; ++j) {
+            _mm_storeu_ps(po + 4 * j, columns[j]);
+        }
+#else
+        out = a * b;
+#endif
+    }
+
+    //out = a * b * c
+    static void multiply(const glm::mat4& a, const glm::mat4& b, const glm::mat4& c, glm::mat4& out) {
+        glm::mat4 ab;
+        multiply(a, b, ab);
+        multiply(ab, c, out);
+    }
+
+    //out[i] = a[i] * b[i] * c[i] for the count entries of indices, e.g. rotate * scale * translate of the dirty
+    //local transforms. batchWidth matrices are transposed so that each lane of a register holds an element of a
+    //different one, a multiply then computes that element for all of them. The sums are added in the order of
+    //multiply, every product is the same bit for bit whichever path computes it
+    static void composeBatch(const glm::mat4* a, const glm::mat4* b, const glm::mat4* c, glm::mat4* out,
+                             const uint32_t* indices, const uint32_t count) {
+        uint32_t i = 0;
+#if defined(TRANSFORM_KERNELS_SSE) || defined(TRANSFORM_KERNELS_AVX)
+        for (; i + batchWidth <= count; i += batchWidth) {
+            Lanes la[16];
+            Lanes lb[16];
+            Lanes ab[16];
+            gather(a, indices + i, la);
+            gather(b, indices + i, lb);
+            multiplyLanes(la, lb, ab);
+            gather(c, indices + i, la);
+            multiplyLanes(ab, la, lb);
+            scatter(lb, indices + i, out);
+        }
+#endif
+        for (; i < count; ++i) {
+            const uint32_t index = indices[i];
+            multiply(a[index], b[index], c[index], out[index]);
+        }
+    }
+
+    //Last row is (0, 0, 0, 1)
+    static bool isAffine(const glm::mat4& m) {
+        return m[0][3] == 0.0f && m[1][3] == 0.0f && m[2][3] == 0.0f && m[3][3] == 1.0f;
+    }
+
+    //Inverse of an affine matrix: the inverse of the upper 3x3 from cross products and the translation
+    //moved back by it, a fraction of the work of a general 4x4 inverse
+    static glm::mat4 affineInverse(const glm::mat4& m) {
+        const glm::vec3 c0(m[0]);
+        const glm::vec3 c1(m[1]);
+        const glm::vec3 c2(m[2]);
+        const glm::vec3 t(m[3]);
+
+        const glm::vec3 r0 = glm::cross(c1, c2);
+        const glm::vec3 r1 = glm::cross(c2, c0);
+        const glm::vec3 r2 = glm::cross(c0, c1);
+        const float invDet = 1.0f / glm::dot(c0, r0);
+
+        //Rows of the inverse of the 3x3
+        const glm::vec3 i0 = r0 * invDet;
+        const glm::vec3 i1 = r1 * invDet;
+        const glm::vec3 i2 = r2 * invDet;
+
+        glm::mat4 inverse(1.0f);
+        inverse[0] = glm::vec4(i0.x, i1.x, i2.x, 0.0f);
+        inverse[1] = glm::vec4(i0.y, i1.y, i2.y, 0.0f);
+        inverse[2] = glm::vec4(i0.z, i1.z, i2.z, 0.0f);
+        inverse[3] = glm::vec4(-glm::dot(i0, t), -glm::dot(i1, t), -glm::dot(i2, t), 1.0f);
+        return inverse;
+    }
+
+    //Affine fast path, the general inverse for projective matrices
+    static glm::mat4 inverse(const glm::mat4& m) {
+        return isAffine(m) ? affineInverse(m) : glm::inverse(m);
+    }
+
+private:
+
+#if defined(TRANSFORM_KERNELS_AVX)
+    using Lanes = __m256;
+
+    static Lanes add(const Lanes a, const Lanes b) { return _mm256_add_ps(a, b); }
+    static Lanes mul(const Lanes a, const Lanes b) { return _mm256_mul_ps(a, b); }
+
+    //Transpose within each 128 bit half: four columns in, the same row of the four out
+    static void transpose(Lanes& r0, Lanes& r1, Lanes& r2, Lanes& r3) {
+        const Lanes t0 = _mm256_unpacklo_ps(r0, r1);
+        const Lanes t1 = _mm256_unpackhi_ps(r0, r1);
+        const Lanes t2 = _mm256_unpacklo_ps(r2, r3);
+        const Lanes t3 = _mm256_unpackhi_ps(r2, r3);
+        r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+        r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    }
+
+    //Column of the matrices k and k + 4 in the low and high half
+    static Lanes loadColumn(const glm::mat4* m, const uint32_t* indices, const uint32_t k, const uint32_t column) {
+        const __m128 low = _mm_loadu_ps(&m[indices[k]][column][0]);
+        const __m128 high = _mm_loadu_ps(&m[indices[k + 4]][column][0]);
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1);
+    }
+
+    static void storeColumn(const Lanes values, glm::mat4* m, const uint32_t* indices, const uint32_t k, const uint32_t column) {
+        _mm_storeu_ps(&m[indices[k]][column][0], _mm256_castps256_ps128(values));
+        _mm_storeu_ps(&m[indices[k + 4]][column][0], _mm256_extractf128_ps(values, 1));
+    }
+#elif defined(TRANSFORM_KERNELS_SSE)
+    using Lanes = __m128;
+
+    static Lanes add(const Lanes a, const Lanes b) { return _mm_add_ps(a, b); }
+    static Lanes mul(const Lanes a, const Lanes b) { return _mm_mul_ps(a, b); }
+
+    static void transpose(Lanes& r0, Lanes& r1, Lanes& r2, Lanes& r3) {
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    }
+
+    static Lanes loadColumn(const glm::mat4* m, const uint32_t* indices, const uint32_t k, const uint32_t column) {
+        return _mm_loadu_ps(&m[indices[k]][column][0]);
+    }
+
+    static void storeColumn(const Lanes values, glm::mat4* m, const uint32_t* indices, const uint32_t k, const uint32_t column) {
+        _mm_storeu_ps(&m[indices[k]][column][0], values);
+    }
+#endif
+
+#if defined(TRANSFORM_KERNELS_SSE) || defined(TRANSFORM_KERNELS_AVX)
+    //lanes[4 * column + row] holds that element of the matrices at indices[0..batchWidth)
+    static void gather(const glm::mat4* m, const uint32_t* indices, Lanes* lanes) {
+        for (uint32_t column = 0; column < 4; ++column) {
+            Lanes* rows = lanes + 4 * column;
+            rows[0] = loadColumn(m, indices, 0, column);
+            rows[1] = loadColumn(m, indices, 1, column);
+            rows[2] = loadColumn(m, indices, 2, column);
+            rows[3] = loadColumn(m, indices, 3, column);
+            transpose(rows[0], rows[1], rows[2], rows[3]);
+        }
+    }
+
+    static void scatter(const Lanes* lanes, const uint32_t* indices, glm::mat4* m) {
+        for (uint32_t column = 0; column < 4; ++column) {
+            Lanes columns[4] = {lanes[4 * column], lanes[4 * column + 1], lanes[4 * column + 2], lanes[4 * column + 3]};
+            transpose(columns[0], columns[1], columns[2], columns[3]);
+            storeColumn(columns[0], m, indices, 0, column);
+            storeColumn(columns[1], m, indices, 1, column);
+            storeColumn(columns[2], m, indices, 2, column);
+            storeColumn(columns[3], m, indices, 3, column);
+        }
+    }
+
+    //out = a * b for every lane, out[j][i] = (a[0][i] * b[j][0] + a[1][i] * b[j][1]) + (a[2][i] * b[j][2] + a[3][i] * b[j][3])
+    static void multiplyLanes(const Lanes* a, const Lanes* b, Lanes* out) {
+        for (uint32_t column = 0; column < 4; ++column) {
+            const Lanes b0 = b[4 * column];
+            const Lanes b1 = b[4 * column + 1];
+            const Lanes b2 = b[4 * column + 2];
+            const Lanes b3 = b[4 * column + 3];
+            Lanes* o = out + 4 * column;
+            o[0] = add(add(mul(a[0], b0), mul(a[4], b1)), add(mul(a[8], b2), mul(a[12], b3)));
+            o[1] = add(add(mul(a[1], b0), mul(a[5], b1)), add(mul(a[9], b2), mul(a[13], b3)));
+            o[2] = add(add(mul(a[2], b0), mul(a[6], b1)), add(mul(a[10], b2), mul(a[14], b3)));
+            o[3] = add(add(mul(a[3], b0), mul(a[7], b1)), add(mul(a[11], b2), mul(a[15], b3)));
+        }
+    }
+#endif
+
+#if defined(TRANSFORM_KERNELS_AVX)
+    static __m256 combine(const __m256 a0, const __m256 a1, const __m256 a2, const __m256 a3, const __m256 b) {
+        const __m256 lo = _mm256_add_ps(_mm256_mul_ps(a0, _mm256_permute_ps(b, _MM_SHUFFLE(0, 0, 0, 0))),
+                                        _mm256_mul_ps(a1, _mm256_permute_ps(b, _MM_SHUFFLE(1, 1, 1, 1))));
+        const __m256 hi = _mm256_add_ps(_mm256_mul_ps(a2, _mm256_permute_ps(b, _MM_SHUFFLE(2, 2, 2, 2))),
+                                        _mm256_mul_ps(a3, _mm256_permute_ps(b, _MM_SHUFFLE(3, 3, 3, 3))));
+        return _mm256_add_ps(lo, hi);
+    }
+#endif
+};
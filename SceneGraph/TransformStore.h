@@ -0,0 +1,380 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include "TransformKernels.h"
+#include "../ThreadPool.h"
+
+//Transforms of every node in structure of arrays form. Entries are kept ordered so that a parent always comes
+//before its children (depth first, every subtree is contiguous), this way the world matrices are computed by a
+//single linear pass. Nodes refer to their entry through a handle, the index of an entry changes when the
+//hierarchy is reordered
+class TransformStore {
+public:
+    using Handle = uint32_t;
+    static constexpr uint32_t none = UINT32_MAX;
+
+private:
+    //Per entry, indexed by position
+    std::vector<uint32_t> mParent;
+    std::vector<Handle> mHandle;
+    //One past the last entry of the subtree, the subtree of i is [i, mSubtreeEnd[i])
+    std::vector<uint32_t> mSubtreeEnd;
+
+    std::vector<glm::mat4> mScale;
+    std::vector<glm::mat4> mScaleInverse;
+    std::vector<glm::mat4> mTranslate;
+    std::vector<glm::mat4> mTranslateInverse;
+    std::vector<glm::mat4> mRotate;
+    std::vector<glm::mat4> mRotateInverse;
+
+    //Composed local transform, recomputed only for the dirty entries
+    std::vector<glm::mat4> mLocal;
+    std::vector<glm::mat4> mLocalInverse;
+
+    std::vector<glm::mat4> mWorld;
+    std::vector<glm::mat4> mWorldInverse;
+
+    //Local transform changed since the last update
+    std::vector<uint8_t> mDirty;
+    //World matrix changed by the last update, read by the children of the entry
+    std::vector<uint8_t> mChanged;
+    //Bumped every time the world matrix gets a different value, consumers compare it with the last one they read
+    std::vector<uint32_t> mVersion;
+    //Released entries stay until the next reorder, their children become roots then
+    std::vector<uint8_t> mAlive;
+
+    //Per handle
+    std::vector<uint32_t> mIndex;
+    std::vector<Handle> mFreeHandles;
+
+    uint32_t mNOfDirty{0};
+    bool mOrderChanged{false};
+
+public:
+
+    Handle create() {
+        Handle handle;
+        if (mFreeHandles.empty()) {
+            handle = mIndex.size();
+            mIndex.push_back(none);
+        } else {
+            handle = mFreeHandles.back();
+            mFreeHandles.pop_back();
+        }
+
+        const glm::mat4 identity(1.0f);
+        mIndex[handle] = mParent.size();
+        mParent.push_back(none);
+        mHandle.push_back(handle);
+        mSubtreeEnd.push_back(mParent.size());
+        mScale.push_back(identity);
+        mScaleInverse.push_back(identity);
+        mTranslate.push_back(identity);
+        mTranslateInverse.push_back(identity);
+        mRotate.push_back(identity);
+        mRotateInverse.push_back(identity);
+        mLocal.push_back(identity);
+        mLocalInverse.push_back(identity);
+        mWorld.push_back(identity);
+        mWorldInverse.push_back(identity);
+        mDirty.push_back(1);
+        mChanged.push_back(0);
+        mVersion.push_back(0);
+        mAlive.push_back(1);
+        ++mNOfDirty;
+        return handle;
+    }
+
+    //New entry with the same local and world transforms and parent
+    Handle clone(const Handle other) {
+        const Handle handle = create();
+        const uint32_t from = mIndex[other];
+        const uint32_t to = mIndex[handle];
+        mScale[to] = mScale[from];
+        mScaleInverse[to] = mScaleInverse[from];
+        mTranslate[to] = mTranslate[from];
+        mTranslateInverse[to] = mTranslateInverse[from];
+        mRotate[to] = mRotate[from];
+        mRotateInverse[to] = mRotateInverse[from];
+        mLocal[to] = mLocal[from];
+        mLocalInverse[to] = mLocalInverse[from];
+        mWorld[to] = mWorld[from];
+        mWorldInverse[to] = mWorldInverse[from];
+        if (mParent[from] != none) {
+            mParent[to] = mParent[from];
+            mOrderChanged = true;
+        }
+        return handle;
+    }
+
+    void release(const Handle handle) {
+        const uint32_t index = mIndex[handle];
+        if (mDirty[index]) {
+            mDirty[index] = 0;
+            --mNOfDirty;
+        }
+        mAlive[index] = 0;
+        mIndex[handle] = none;
+        mFreeHandles.push_back(handle);
+        mOrderChanged = true;
+    }
+
+    //Parent none makes the entry a root
+    void setParent(const Handle handle, const Handle parent) {
+        mParent[mIndex[handle]] = parent == none ? none : mIndex[parent];
+        mOrderChanged = true;
+        markDirty(handle);
+    }
+
+    void markDirty(const Handle handle) {
+        const uint32_t index = mIndex[handle];
+        if (!mDirty[index]) {
+            mDirty[index] = 1;
+            ++mNOfDirty;
+        }
+    }
+
+    glm::mat4& scale(const Handle handle) { return mScale[mIndex[handle]]; }
+    glm::mat4& scaleInverse(const Handle handle) { return mScaleInverse[mIndex[handle]]; }
+    glm::mat4& translate(const Handle handle) { return mTranslate[mIndex[handle]]; }
+    glm::mat4& translateInverse(const Handle handle) { return mTranslateInverse[mIndex[handle]]; }
+    glm::mat4& rotate(const Handle handle) { return mRotate[mIndex[handle]]; }
+    glm::mat4& rotateInverse(const Handle handle) { return mRotateInverse[mIndex[handle]]; }
+
+    const glm::mat4& world(const Handle handle) const { return mWorld[mIndex[handle]]; }
+    const glm::mat4& worldInverse(const Handle handle) const { return mWorldInverse[mIndex[handle]]; }
+
+    uint32_t version(const Handle handle) const { return mVersion[mIndex[handle]]; }
+
+    uint32_t size() const {
+        return mParent.size();
+    }
+
+    //Compute the world matrices of the dirty entries and of everything below them
+    void update() {
+        if (mOrderChanged) {
+            reorder();
+        }
+        if (mNOfDirty == 0) {
+            return;
+        }
+
+        updateRange(0, mParent.size());
+        mNOfDirty = 0;
+    }
+
+    //Same result as update, independent subtrees are spread across the workers. The entries above subtrees too
+    //large for one task are updated first on the calling thread, then every task updates a contiguous range of
+    //whole subtrees, so each entry is computed exactly as in the serial pass whatever thread runs it
+    void update(ThreadPool& pool) {
+        if (mOrderChanged) {
+            reorder();
+        }
+        if (mNOfDirty == 0) {
+            return;
+        }
+
+        const uint32_t size = mParent.size();
+        const uint32_t grain = std::max(minEntriesPerTask, size / (pool.size() * 4));
+        if (pool.size() < 2 || size < grain * 2) {
+            updateRange(0, size);
+            mNOfDirty = 0;
+            return;
+        }
+
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+        for (uint32_t i = 0; i < size;) {
+            const uint32_t end = mSubtreeEnd[i];
+            if (end - i > grain) {
+                //Children follow their parent, the next iteration starts splitting them
+                updateRange(i, i + 1);
+                ++i;
+                continue;
+            }
+            if (!ranges.empty() && ranges.back().second == i && end - ranges.back().first <= grain) {
+                ranges.back().second = end;
+            } else {
+                ranges.emplace_back(i, end);
+            }
+            i = end;
+        }
+
+        std::vector<ThreadPool::Task> tasks;
+        tasks.reserve(ranges.size());
+        for (const auto& [begin, end] : ranges) {
+            tasks.emplace_back([this, begin, end](const uint32_t) { updateRange(begin, end); });
+        }
+        pool.run(tasks);
+        mNOfDirty = 0;
+    }
+
+private:
+
+    //Fewer entries than this are not worth a task
+    static constexpr uint32_t minEntriesPerTask = 4096;
+    //Entries updated together, their local matrices are still in cache when the world matrices are computed
+    static constexpr uint32_t entriesPerBlock = 128;
+
+    //The parents of the entries in the range are in the range or already updated
+    void updateRange(const uint32_t begin, const uint32_t end) {
+        //Local matrices do not depend on the parent: the dirty ones of a block are composed by the batch kernel,
+        //then the world matrices of the block are propagated in order
+        uint32_t dirty[entriesPerBlock];
+        for (uint32_t block = begin; block < end; block += entriesPerBlock) {
+            const uint32_t blockEnd = std::min(end, block + entriesPerBlock);
+            uint32_t nOfDirty = 0;
+            for (uint32_t i = block; i < blockEnd; ++i) {
+                if (mDirty[i]) {
+                    dirty[nOfDirty++] = i;
+                }
+            }
+            TransformKernels::composeBatch(mRotate.data(), mScale.data(), mTranslate.data(), mLocal.data(),
+                                           dirty, nOfDirty);
+            TransformKernels::composeBatch(mTranslateInverse.data(), mScaleInverse.data(), mRotateInverse.data(),
+                                           mLocalInverse.data(), dirty, nOfDirty);
+            propagateRange(block, blockEnd);
+        }
+    }
+
+    //World matrices of the entries in the range, their local matrices are composed
+    void propagateRange(const uint32_t begin, const uint32_t end) {
+        for (uint32_t i = begin; i < end; ++i) {
+            const uint32_t parent = mParent[i];
+            mChanged[i] = 0;
+            if (!mDirty[i] && (parent == none || !mChanged[parent])) {
+                continue;
+            }
+            mDirty[i] = 0;
+
+            //Setting a transform to the value it already has changes nothing below the entry
+            glm::mat4 world;
+            if (parent == none) {
+                world = mLocal[i];
+            } else {
+                TransformKernels::multiply(mWorld[parent], mLocal[i], world);
+            }
+            if (world == mWorld[i]) {
+                continue;
+            }
+
+            mWorld[i] = world;
+            if (parent == none) {
+                mWorldInverse[i] = mLocalInverse[i];
+            } else {
+                TransformKernels::multiply(mLocalInverse[i], mWorldInverse[parent], mWorldInverse[i]);
+            }
+            mChanged[i] = 1;
+            ++mVersion[i];
+        }
+    }
+
+    template<typename T>
+    static void permute(std::vector<T>& values, const std::vector<uint32_t>& order) {
+        std::vector<T> permuted;
+        permuted.reserve(order.size());
+        for (const uint32_t index : order) {
+            permuted.push_back(values[index]);
+        }
+        values.swap(permuted);
+    }
+
+    //Drop the released entries and sort the rest depth first, the children of released entries become roots
+    void reorder() {
+        const uint32_t size = mParent.size();
+
+        //Children of every entry in a compressed array, firstChild[i]..firstChild[i + 1]
+        std::vector<uint32_t> firstChild(size + 1, 0);
+        std::vector<uint32_t> roots;
+        for (uint32_t i = 0; i < size; ++i) {
+            if (!mAlive[i]) {
+                continue;
+            }
+            const uint32_t parent = mParent[i];
+            if (parent == none || !mAlive[parent]) {
+                roots.push_back(i);
+            } else {
+                ++firstChild[parent + 1];
+            }
+        }
+        for (uint32_t i = 0; i < size; ++i) {
+            firstChild[i + 1] += firstChild[i];
+        }
+        std::vector<uint32_t> children(firstChild[size]);
+        std::vector<uint32_t> filled(firstChild.begin(), firstChild.end() - 1);
+        for (uint32_t i = 0; i < size; ++i) {
+            const uint32_t parent = mParent[i];
+            if (mAlive[i] && parent != none && mAlive[parent]) {
+                children[filled[parent]++] = i;
+            }
+        }
+
+        std::vector<uint32_t> order;
+        order.reserve(size);
+        std::vector<uint32_t> stack;
+        for (const uint32_t root : roots) {
+            stack.push_back(root);
+            while (!stack.empty()) {
+                const uint32_t index = stack.back();
+                stack.pop_back();
+                order.push_back(index);
+                //Pushed in reverse so that siblings keep their relative order
+                for (uint32_t c = firstChild[index + 1]; c > firstChild[index]; --c) {
+                    stack.push_back(children[c - 1]);
+                }
+            }
+        }
+
+        std::vector<uint32_t> newIndex(size, none);
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            newIndex[order[i]] = i;
+        }
+        std::vector<uint32_t> parents(order.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            const uint32_t parent = mParent[order[i]];
+            parents[i] = parent == none ? none : newIndex[parent];
+            //Entries that lost their parent have a new world matrix
+            if (parents[i] == none && parent != none && !mDirty[order[i]]) {
+                mDirty[order[i]] = 1;
+                ++mNOfDirty;
+            }
+        }
+        mParent.swap(parents);
+
+        //In depth first order a subtree ends where the last of its descendants does
+        mSubtreeEnd.resize(order.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            mSubtreeEnd[i] = i + 1;
+        }
+        for (uint32_t i = order.size(); i > 0; --i) {
+            const uint32_t parent = mParent[i - 1];
+            if (parent != none) {
+                mSubtreeEnd[parent] = std::max(mSubtreeEnd[parent], mSubtreeEnd[i - 1]);
+            }
+        }
+
+        permute(mHandle, order);
+        permute(mScale, order);
+        permute(mScaleInverse, order);
+        permute(mTranslate, order);
+        permute(mTranslateInverse, order);
+        permute(mRotate, order);
+        permute(mRotateInverse, order);
+        permute(mLocal, order);
+        permute(mLocalInverse, order);
+        permute(mWorld, order);
+        permute(mWorldInverse, order);
+        permute(mDirty, order);
+        permute(mChanged, order);
+        permute(mVersion, order);
+        permute(mAlive, order);
+
+        for (uint32_t i = 0; i < mHandle.size(); ++i) {
+            mIndex[mHandle[i]] = i;
+        }
+        mOrderChanged = false;
+    }
+};
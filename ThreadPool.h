@@ -0,0 +1,168 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <atomic>
+
+//Fixed set of worker threads that run batches of tasks.
+//Every task receives the index of the worker that runs it, so that per-thread resources
+//(e.g. command pools) can be picked without any locking.
+//Each worker has its own queue: a batch is dealt round robin across them, a worker takes the newest task of its
+//own queue and when it is empty steals the oldest one of another worker, so uneven tasks still keep every core busy
+class ThreadPool {
+public:
+    using Task = std::function<void(uint32_t)>;
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::thread> m_workers;
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+
+    std::mutex m_mutex;
+    std::condition_variable m_work_available;
+    std::condition_variable m_work_done;
+
+    //Tasks queued and not taken yet, and tasks of the batch not finished yet
+    std::atomic<uint32_t> m_queued{0};
+    uint32_t m_pending{0};
+    bool m_stop{false};
+
+    //First exception thrown by a task of the current batch, rethrown by run
+    std::exception_ptr m_error;
+
+public:
+    explicit ThreadPool(const uint32_t nOfThreads = std::max(1u, std::thread::hardware_concurrency())) {
+        m_queues.reserve(nOfThreads);
+        for (uint32_t i = 0; i < nOfThreads; ++i) {
+            m_queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        m_workers.reserve(nOfThreads);
+        for (uint32_t i = 0; i < nOfThreads; ++i) {
+            m_workers.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_work_available.notify_all();
+        for (auto& worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    uint32_t size() const {
+        return m_workers.size();
+    }
+
+    //Run every task on the workers and return when all of them are done,
+    //an exception thrown by a task is rethrown here once the whole batch is over
+    void run(const std::vector<Task>& tasks) {
+        if (tasks.empty()) {
+            return;
+        }
+
+        {
+            //Counted before they are queued so that the count never goes below the tasks actually there,
+            //a worker that sees the count early just retries until the task shows up
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending += tasks.size();
+            m_queued += tasks.size();
+        }
+        for (uint32_t i = 0; i < tasks.size(); ++i) {
+            auto& queue = *m_queues[i % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(tasks[i]);
+        }
+        m_work_available.notify_all();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_work_done.wait(lock, [this]() { return m_pending == 0; });
+        if (m_error) {
+            std::exception_ptr error = m_error;
+            m_error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+
+    bool take(const uint32_t index, Task& task) {
+        {
+            auto& own = *m_queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                --m_queued;
+                return true;
+            }
+        }
+        for (uint32_t i = 1; i < m_queues.size(); ++i) {
+            auto& victim = *m_queues[(index + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                --m_queued;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(const uint32_t index) {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_work_available.wait(lock, [this]() { return m_stop || m_queued > 0; });
+                if (m_stop && m_queued == 0) {
+                    return;
+                }
+            }
+
+            Task task;
+            if (!take(index, task)) {
+                //Another worker got it first, or it is still being queued
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::exception_ptr error;
+            try {
+                task(index);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            bool last;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (error && !m_error) {
+                    m_error = error;
+                }
+                last = --m_pending == 0;
+            }
+            if (last) {
+                m_work_done.notify_all();
+            }
+        }
+    }
+
+};
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <map>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+//A range of device memory handed out by the MemoryAllocator, resources are bound
+//at offset inside memory which can be shared with other resources
+struct Allocation {
+    VkDeviceMemory memory{VK_NULL_HANDLE};
+    VkDeviceSize offset{0};
+    VkDeviceSize size{0};
+
+    uint32_t memory_type{0};
+    uint32_t pool{0};
+    //Index of the block inside the pool, dedicated allocations have no block
+    uint32_t block{UINT32_MAX};
+
+    //Host visible memory stays mapped for its whole life, this points at offset
+    void* mapped{nullptr};
+};
+
+//Sub-allocates buffers and images from big blocks of device memory instead of doing
+//one vkAllocateMemory for every resource.
+//There is a pool for every memory type, linear resources (buffers) and optimal tiled images
+//get separate pools so that bufferImageGranularity never has to be taken into account.
+//Inside a block the free ranges are kept ordered by offset to merge them when they are released
+//and indexed by size for a best fit search.
+//Host visible blocks are mapped once when they are allocated, writes go straight through
+//the mapped pointer and are flushed only when the memory type is not coherent.
+class MemoryAllocator {
+private:
+
+    struct Block {
+        VkDeviceMemory memory{VK_NULL_HANDLE};
+        VkDeviceSize size{0};
+        VkDeviceSize used{0};
+        void* mapped{nullptr};
+
+        std::map<VkDeviceSize, VkDeviceSize> freeByOffset;
+        std::multimap<VkDeviceSize, VkDeviceSize> freeBySize;
+    };
+
+    struct Pool {
+        uint32_t memory_type;
+        bool linear;
+        std::vector<Block> blocks;
+    };
+
+    VkPhysicalDevice m_pdevice = VK_NULL_HANDLE;
+    VkDevice m_device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties m_memory_props{};
+    VkDeviceSize m_non_coherent_atom{1};
+
+    VkDeviceSize m_block_size{0};
+    std::vector<Pool> m_pools;
+
+    uint32_t m_device_allocations{0};
+    uint32_t m_live_allocations{0};
+
+public:
+    static constexpr VkDeviceSize defaultBlockSize = 64 * 1024 * 1024;
+
+    void init(const VkPhysicalDevice pdevice, const VkDevice device, const VkDeviceSize blockSize = defaultBlockSize) {
+        m_pdevice = pdevice;
+        m_device = device;
+        m_block_size = blockSize;
+        vkGetPhysicalDeviceMemoryProperties(m_pdevice, &m_memory_props);
+
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(m_pdevice, &props);
+        m_non_coherent_atom = props.limits.nonCoherentAtomSize;
+    }
+
+    //Allocate memory for the buffer and bind it
+    Allocation allocateForBuffer(const VkBuffer buffer, const VkMemoryPropertyFlags flags) {
+        VkMemoryRequirements reqs;
+        vkGetBufferMemoryRequirements(m_device, buffer, &reqs);
+
+        Allocation allocation = allocate(reqs, flags, true);
+        vkBindBufferMemory(m_device, buffer, allocation.memory, allocation.offset);
+        return allocation;
+    }
+
+    //Allocate memory for the image and bind it, images are always considered optimal tiled
+    Allocation allocateForImage(const VkImage image, const VkMemoryPropertyFlags flags) {
+        VkMemoryRequirements reqs;
+        vkGetImageMemoryRequirements(m_device, image, &reqs);
+
+        Allocation allocation = allocate(reqs, flags, false);
+        vkBindImageMemory(m_device, image, allocation.memory, allocation.offset);
+        return allocation;
+    }
+
+    Allocation allocate(const VkMemoryRequirements& reqs, const VkMemoryPropertyFlags flags, const bool linear) {
+        const uint32_t memory_type = findMemoryType(reqs.memoryTypeBits, flags);
+
+        //Big resources would waste most of a block, they get their own memory
+        if (reqs.size > m_block_size / 2) {
+            Allocation allocation{};
+            allocation.memory = allocateDeviceMemory(reqs.size, memory_type);
+            allocation.size = reqs.size;
+            allocation.memory_type = memory_type;
+            allocation.mapped = mapIfHostVisible(allocation.memory, memory_type);
+            ++m_live_allocations;
+            return allocation;
+        }
+
+        const uint32_t pool_index = poolFor(memory_type, linear);
+        Pool& pool = m_pools[pool_index];
+
+        for (uint32_t i = 0; i < pool.blocks.size(); ++i) {
+            VkDeviceSize offset;
+            if (pool.blocks[i].memory != VK_NULL_HANDLE && takeFromBlock(pool.blocks[i], reqs.size, reqs.alignment, offset)) {
+                return makeAllocation(pool_index, i, offset, reqs.size);
+            }
+        }
+
+        //No block has enough space, reuse a slot of a released block or append a new one
+        uint32_t block_index = 0;
+        while (block_index < pool.blocks.size() && pool.blocks[block_index].memory != VK_NULL_HANDLE) {
+            ++block_index;
+        }
+        if (block_index == pool.blocks.size()) {
+            pool.blocks.emplace_back();
+        }
+
+        Block& block = pool.blocks[block_index];
+        block.memory = allocateDeviceMemory(m_block_size, memory_type);
+        block.size = m_block_size;
+        block.used = 0;
+        block.mapped = mapIfHostVisible(block.memory, memory_type);
+        insertFreeRange(block, 0, m_block_size);
+
+        VkDeviceSize offset;
+        takeFromBlock(block, reqs.size, reqs.alignment, offset);
+        return makeAllocation(pool_index, block_index, offset, reqs.size);
+    }
+
+    void free(const Allocation& allocation) {
+        if (allocation.memory == VK_NULL_HANDLE) {
+            return;
+        }
+        --m_live_allocations;
+
+        if (allocation.block == UINT32_MAX) {
+            vkFreeMemory(m_device, allocation.memory, nullptr);
+            --m_device_allocations;
+            return;
+        }
+
+        Pool& pool = m_pools[allocation.pool];
+        Block& block = pool.blocks[allocation.block];
+        block.used -= allocation.size;
+        releaseRange(block, allocation.offset, allocation.size);
+
+        //Give empty blocks back to the driver but keep one around to avoid
+        //allocating and freeing a block when a single resource is created and destroyed repeatedly
+        if (block.used == 0) {
+            const auto liveBlocks = std::count_if(pool.blocks.begin(), pool.blocks.end(), [](const auto& b){
+                return b.memory != VK_NULL_HANDLE;
+            });
+            if (liveBlocks > 1) {
+                vkFreeMemory(m_device, block.memory, nullptr);
+                --m_device_allocations;
+                block = Block{};
+            }
+        }
+    }
+
+    //Free every block, all the allocations made from this allocator become invalid
+    void destroy() {
+        for (auto& pool : m_pools) {
+            for (auto& block : pool.blocks) {
+                if (block.memory != VK_NULL_HANDLE) {
+                    vkFreeMemory(m_device, block.memory, nullptr);
+                }
+            }
+        }
+        m_pools.clear();
+        m_device_allocations = 0;
+        m_live_allocations = 0;
+    }
+
+    //Copy into a host visible allocation through its persistent mapping
+    void write(const Allocation& allocation, const void* data, const VkDeviceSize size, const VkDeviceSize offset = 0) {
+        memcpy(static_cast<char*>(allocation.mapped) + offset, data, size);
+        flush(allocation, offset, size);
+    }
+
+    //Make host writes visible to the device, a no-op for coherent memory
+    void flush(const Allocation& allocation, const VkDeviceSize offset = 0, const VkDeviceSize size = VK_WHOLE_SIZE) {
+        if (isCoherent(allocation)) {
+            return;
+        }
+        const VkMappedMemoryRange range = alignedRange(allocation, offset, size);
+        vkFlushMappedMemoryRanges(m_device, 1, &range);
+    }
+
+    //Make device writes visible to the host, a no-op for coherent memory
+    void invalidate(const Allocation& allocation, const VkDeviceSize offset = 0, const VkDeviceSize size = VK_WHOLE_SIZE) {
+        if (isCoherent(allocation)) {
+            return;
+        }
+        const VkMappedMemoryRange range = alignedRange(allocation, offset, size);
+        vkInvalidateMappedMemoryRanges(m_device, 1, &range);
+    }
+
+    //Number of vkAllocateMemory that are alive
+    uint32_t deviceAllocationCount() const {
+        return m_device_allocations;
+    }
+
+    //Number of resources that are using memory from this allocator
+    uint32_t allocationCount() const {
+        return m_live_allocations;
+    }
+
+    uint32_t findMemoryType(const uint32_t typeBits, const VkMemoryPropertyFlags flags) const {
+        for (uint32_t i = 0; i < m_memory_props.memoryTypeCount; ++i) {
+            if ((typeBits & (1 << i)) &&
+                (m_memory_props.memoryTypes[i].propertyFlags & flags) == flags) {
+                return i;
+            }
+        }
+        throw std::runtime_error("No memory type with the requested properties");
+    }
+
+    VkMemoryPropertyFlags memoryTypeFlags(const uint32_t memory_type) const {
+        return m_memory_props.memoryTypes[memory_type].propertyFlags;
+    }
+
+private:
+
+    //Freeing the memory unmaps it, there is no matching vkUnmapMemory
+    void* mapIfHostVisible(const VkDeviceMemory memory, const uint32_t memory_type) {
+        if (!(memoryTypeFlags(memory_type) & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+            return nullptr;
+        }
+        void* mapped;
+        if (vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &mapped) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to map device memory");
+        }
+        return mapped;
+    }
+
+    bool isCoherent(const Allocation& allocation) const {
+        return memoryTypeFlags(allocation.memory_type) & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    }
+
+    //Flushed ranges must start and end on nonCoherentAtomSize boundaries of the whole memory object
+    VkMappedMemoryRange alignedRange(const Allocation& allocation, const VkDeviceSize offset, const VkDeviceSize size) const {
+        const VkDeviceSize memory_size = allocation.block == UINT32_MAX ? allocation.size : m_block_size;
+        const VkDeviceSize begin = allocation.offset + offset;
+        const VkDeviceSize end = size == VK_WHOLE_SIZE ? allocation.offset + allocation.size : begin + size;
+
+        VkMappedMemoryRange range{};
+        range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+        range.memory = allocation.memory;
+        range.offset = begin / m_non_coherent_atom * m_non_coherent_atom;
+        const VkDeviceSize aligned_end = (end + m_non_coherent_atom - 1) / m_non_coherent_atom * m_non_coherent_atom;
+        range.size = aligned_end >= memory_size ? VK_WHOLE_SIZE : aligned_end - range.offset;
+        return range;
+    }
+
+    uint32_t poolFor(const uint32_t memory_type, const bool linear) {
+        for (uint32_t i = 0; i < m_pools.size(); ++i) {
+            if (m_pools[i].memory_type == memory_type && m_pools[i].linear == linear) {
+                return i;
+            }
+        }
+        m_pools.push_back(Pool{memory_type, linear, {}});
+        return m_pools.size() - 1;
+    }
+
+    VkDeviceMemory allocateDeviceMemory(const VkDeviceSize size, const uint32_t memory_type) {
+        VkMemoryAllocateInfo alloc_info{};
+        alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        alloc_info.allocationSize = size;
+        alloc_info.memoryTypeIndex = memory_type;
+
+        VkDeviceMemory memory;
+        if (vkAllocateMemory(m_device, &alloc_info, nullptr, &memory) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to allocate device memory");
+        }
+        ++m_device_allocations;
+        return memory;
+    }
+
+    Allocation makeAllocation(const uint32_t pool_index, const uint32_t block_index,
+                              const VkDeviceSize offset, const VkDeviceSize size) {
+        Block& block = m_pools[pool_index].blocks[block_index];
+        block.used += size;
+        ++m_live_allocations;
+
+        Allocation allocation{};
+        allocation.memory = block.memory;
+        allocation.offset = offset;
+        allocation.size = size;
+        allocation.memory_type = m_pools[pool_index].memory_type;
+        allocation.pool = pool_index;
+        allocation.block = block_index;
+        allocation.mapped = block.mapped ? static_cast<char*>(block.mapped) + offset : nullptr;
+        return allocation;
+    }
+
+    //Best fit: the smallest free range that can hold the size once aligned
+    bool takeFromBlock(Block& block, const VkDeviceSize size, const VkDeviceSize alignment, VkDeviceSize& outOffset) {
+        for (auto it = block.freeBySize.lower_bound(size); it != block.freeBySize.end(); ++it) {
+            const VkDeviceSize range_offset = it->second;
+            const VkDeviceSize range_size = it->first;
+            const VkDeviceSize aligned = (range_offset + alignment - 1) / alignment * alignment;
+            const VkDeviceSize padding = aligned - range_offset;
+            if (padding + size > range_size) {
+                continue;
+            }
+
+            eraseFreeRange(block, range_offset, range_size);
+            //The padding before and the tail after the allocation go back in the free lists
+            if (padding > 0) {
+                insertFreeRange(block, range_offset, padding);
+            }
+            if (padding + size < range_size) {
+                insertFreeRange(block, aligned + size, range_size - padding - size);
+            }
+
+            outOffset = aligned;
+            return true;
+        }
+        return false;
+    }
+
+    //Put the range back merging it with the free neighbours
+    void releaseRange(Block& block, VkDeviceSize offset, VkDeviceSize size) {
+        auto next = block.freeByOffset.lower_bound(offset);
+        if (next != block.freeByOffset.end() && offset + size == next->first) {
+            const VkDeviceSize next_offset = next->first;
+            const VkDeviceSize next_size = next->second;
+            eraseFreeRange(block, next_offset, next_size);
+            size += next_size;
+        }
+
+        auto prev = block.freeByOffset.lower_bound(offset);
+        if (prev != block.freeByOffset.begin()) {
+            --prev;
+            if (prev->first + prev->second == offset) {
+                const VkDeviceSize prev_offset = prev->first;
+                const VkDeviceSize prev_size = prev->second;
+                eraseFreeRange(block, prev_offset, prev_size);
+                offset = prev_offset;
+                size += prev_size;
+            }
+        }
+
+        insertFreeRange(block, offset, size);
+    }
+
+    void insertFreeRange(Block& block, const VkDeviceSize offset, const VkDeviceSize size) {
+        block.freeByOffset.emplace(offset, size);
+        block.freeBySize.emplace(size, offset);
+    }
+
+    void eraseFreeRange(Block& block, const VkDeviceSize offset, const VkDeviceSize size) {
+        block.freeByOffset.erase(offset);
+        auto [begin, end] = block.freeBySize.equal_range(size);
+        for (auto it = begin; it != end; ++it) {
+            if (it->second == offset) {
+                block.freeBySize.erase(it);
+                break;
+            }
+        }
+    }
+
+};
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <array>
+#include <map>
+#include <string>
+#include <bit>
+#include <algorithm>
+#include <unordered_map>
+#include <glm/glm.hpp>
+#include "Resources.h"
+
+//Number of commands recorded for a frame, used to check how much sorting the draws saves
+struct RenderStats {
+    uint32_t draws{0};
+    uint32_t instances{0};
+    uint32_t pipelineBinds{0};
+    uint32_t descriptorBinds{0};
+    uint32_t vertexBufferBinds{0};
+    uint32_t indexBufferBinds{0};
+    //Objects drawn and objects culled, summed over the camera and every light
+    uint32_t visibleObjects{0};
+    uint32_t culledObjects{0};
+
+    uint32_t binds() const {
+        return pipelineBinds + descriptorBinds + vertexBufferBinds + indexBufferBinds;
+    }
+
+    RenderStats& operator+=(const RenderStats& other) {
+        draws += other.draws;
+        instances += other.instances;
+        pipelineBinds += other.pipelineBinds;
+        descriptorBinds += other.descriptorBinds;
+        vertexBufferBinds += other.vertexBufferBinds;
+        indexBufferBinds += other.indexBufferBinds;
+        visibleObjects += other.visibleObjects;
+        culledObjects += other.culledObjects;
+        return *this;
+    }
+};
+
+//One draw, the sets bound from set 1 are sets[firstSet, firstSet + nOfSets) of the owning DrawList.
+//The draw is instanced: instances[firstInstance, firstInstance + nOfInstances) are the transform slots of the
+//objects it draws, the shaders read them with gl_InstanceIndex
+struct DrawItem {
+    uint64_t key;
+    const RenderObject* object;
+    uint32_t firstSet;
+    uint32_t nOfSets;
+    uint32_t firstInstance;
+    uint32_t nOfInstances;
+};
+
+struct DrawList {
+    std::vector<DrawItem> items;
+    std::vector<VkDescriptorSet> sets;
+    std::vector<uint32_t> instances;
+};
+
+//Most significant field first, so that draws sharing a pipeline, then a material, then a geometry end up next to
+//each other. The depth only orders draws with the same state, front to back
+inline uint64_t makeSortKey(const uint16_t pipeline, const uint16_t material, const uint16_t geometry, const uint16_t depth) {
+    return static_cast<uint64_t>(pipeline) << 48 |
+           static_cast<uint64_t>(material) << 32 |
+           static_cast<uint64_t>(geometry) << 16 |
+           static_cast<uint64_t>(depth);
+}
+
+//Positive floats compare like their bit patterns, the top 16 bits keep the exponent and part of the mantissa
+inline uint16_t quantizeDepth(const float distance) {
+    return std::bit_cast<uint32_t>(std::max(distance, 0.0f)) >> 16;
+}
+
+//Dense ids for the handles found while building a list, they only need to group equal handles together.
+//Past 65536 distinct handles the ids wrap, which makes the sort worse but the draws stay correct
+template<typename T>
+class HandleIds {
+    std::unordered_map<T, uint16_t> m_ids;
+
+public:
+    uint16_t get(const T handle) {
+        return m_ids.try_emplace(handle, static_cast<uint16_t>(m_ids.size())).first->second;
+    }
+};
+
+//LSD radix sort on the keys, one byte per pass. Passes where every key has the same byte are skipped,
+//with few pipelines and materials most of the high bytes are
+inline void radixSort(std::vector<DrawItem>& items) {
+    std::vector<DrawItem> sorted(items.size());
+    for (uint32_t shift = 0; shift < 64; shift += 8) {
+        std::array<uint32_t, 256> offsets{};
+        for (const auto& item : items) {
+            ++offsets[(item.key >> shift) & 0xFF];
+        }
+        if (std::find(offsets.begin(), offsets.end(), items.size()) != offsets.end()) {
+            continue;
+        }
+
+        uint32_t offset = 0;
+        for (auto& count : offsets) {
+            const uint32_t size = count;
+            count = offset;
+            offset += size;
+        }
+        for (const auto& item : items) {
+            sorted[offsets[(item.key >> shift) & 0xFF]++] = item;
+        }
+        items.swap(sorted);
+    }
+}
+
+inline bool sameGeometry(const GeometryBuffer& a, const GeometryBuffer& b) {
+    return a.buffer == b.buffer && a.vertices_offset == b.vertices_offset && a.indices_offset == b.indices_offset;
+}
+
+//Objects drawn with the same pipeline, sets and geometry can be a single instanced draw
+inline bool canInstance(const DrawList& list, const DrawItem& a, const DrawItem& b) {
+    return a.object->pipeline.pipeline == b.object->pipeline.pipeline &&
+           sameGeometry(a.object->geometry, b.object->geometry) &&
+           a.nOfSets == b.nOfSets &&
+           std::equal(list.sets.begin() + a.firstSet, list.sets.begin() + a.firstSet + a.nOfSets,
+                      list.sets.begin() + b.firstSet);
+}
+
+//Sorting put the objects that can be instanced next to each other, every run of them becomes one draw
+inline void mergeInstances(DrawList& list) {
+    list.instances.clear();
+    list.instances.reserve(list.items.size());
+
+    uint32_t merged = 0;
+    for (uint32_t i = 0; i < list.items.size(); ++i) {
+        const DrawItem& item = list.items[i];
+        if (merged > 0 && canInstance(list, list.items[merged - 1], item)) {
+            ++list.items[merged - 1].nOfInstances;
+        } else {
+            list.items[merged] = item;
+            list.items[merged].firstInstance = list.instances.size();
+            list.items[merged].nOfInstances = 1;
+            ++merged;
+        }
+        list.instances.push_back(item.object->slot);
+    }
+    list.items.resize(merged);
+}
+
+//Flat list of the draws sorted by state, objects sharing geometry and material are merged into instanced draws.
+//The sets of every draw are gathered once here instead of every time a draw is recorded.
+//objects are the ones visible in the view the list is for
+inline DrawList buildDrawList(const std::vector<const RenderObject*>& objects,
+                              const VkDescriptorSet shadowMapSet,
+                              const glm::vec3& cameraPosition) {
+    DrawList list;
+    list.items.reserve(objects.size());
+
+    HandleIds<VkPipeline> pipelines;
+    HandleIds<VkDescriptorSet> materials;
+    HandleIds<VkBuffer> geometries;
+
+    for (const RenderObject* visible : objects) {
+        const RenderObject& object = *visible;
+        const uint32_t firstSet = list.sets.size();
+        for (const auto& [index, descriptor] : object.descriptors) {
+            list.sets.push_back(descriptor.set);
+        }
+        list.sets.push_back(shadowMapSet);
+
+        const VkDescriptorSet material = object.descriptors.empty() ? VK_NULL_HANDLE : object.descriptors.begin()->second.set;
+        const glm::vec3 position = object.node->modelMatrix()[3];
+
+        list.items.push_back({
+            makeSortKey(pipelines.get(object.pipeline.pipeline),
+                        materials.get(material),
+                        geometries.get(object.geometry.buffer),
+                        quantizeDepth(glm::distance(position, cameraPosition))),
+            &object,
+            firstSet,
+            static_cast<uint32_t>(list.sets.size()) - firstSet,
+            0,
+            1
+        });
+    }
+
+    radixSort(list.items);
+    mergeInstances(list);
+    return list;
+}
@@ -8,11 +8,18 @@
 #include <vector>
 #include <array>
 #include <numeric>
+#include <unordered_map>
 #include "../SceneGraph/BaseNode.h"
 #include "Logger.h"
 #include "Utils.h"
 #include "../SceneGraph/SceneGraphVisitor.h"
+#include "../SceneGraph/SceneRegistry.h"
+#include "../SceneGraph/BVH.h"
 #include "VulkanStructs.h"
+#include "DrawList.h"
+#include "TextureCache.h"
+#include "SamplerCache.h"
+#include "../ThreadPool.h"
 #include "../libs/imgui/imgui.h"
 #include "../libs/imgui/backends/imgui_impl_glfw.h"
 #include "../libs/imgui/backends/imgui_impl_vulkan.h"
@@ -25,11 +32,23 @@ private:
 
         const std::vector<const char *> device_layers = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
         const std::vector<const char *> validation_layers = {"VK_LAYER_KHRONOS_validation"};
+
+        //Validation layers that are actually installed, machines without the SDK have none
+        std::vector<const char *> enabled_layers{};
     } m_instance_data;
 
     VkPhysicalDevice m_pdevice;
     VkDevice m_device;
-    VkSurfaceKHR m_surface;
+    VkSurfaceKHR m_surface = VK_NULL_HANDLE;
+
+    //Every buffer and image of the renderer takes its memory from here
+    MemoryAllocator m_allocator;
+
+    //A headless renderer has no window, surface or swapchain, the final images are
+    //offscreen images that take the place of the swapchain images
+    const bool m_headless;
+    std::vector<Image> offscreen_targets;
+    uint32_t m_last_image_index{0};
 
     VkRenderPass m_render_pass;
 
@@ -51,6 +70,35 @@ private:
         std::vector<VkCommandBuffer> buffers;
     } m_commands;
 
+    //Shadow passes and chunks of the main pass are recorded in parallel into secondary command buffers.
+    //Every worker has its own command pool for every frame in flight, a pool is never touched by two threads
+    struct WorkerCommands {
+        VkCommandPool pool = VK_NULL_HANDLE;
+        std::vector<VkCommandBuffer> secondaries;
+        uint32_t used{0};
+    };
+    ThreadPool m_workers;
+    std::vector<std::vector<WorkerCommands>> m_worker_commands;
+    //Fewer draws than this are not worth a secondary command buffer of their own
+    static constexpr uint32_t minDrawsPerChunk = 64;
+
+    //The secondaries only change when the draw structure does: load, unload and setLights bump the
+    //structure version, a moving light changes the matrices pushed in its shadow pass and objects entering
+    //or leaving a view change the draws. Camera and transforms live in buffers so they are not part of the
+    //recorded commands
+    struct FrameRecording {
+        uint64_t version{UINT64_MAX};
+        std::vector<glm::mat4> lightMatrices;
+        uint64_t visibility{0};
+        std::vector<VkCommandBuffer> shadowCommands;
+        std::vector<VkCommandBuffer> mainCommands;
+        RenderStats stats;
+    };
+    std::vector<FrameRecording> m_recordings;
+    uint64_t m_structure_version{0};
+    //Commands executed by the last rendered frame
+    RenderStats m_stats;
+
     struct QueueInfo {
         uint32_t graphicsFamilyindex;
         VkQueue graphics;
@@ -67,16 +115,95 @@ private:
 
     struct image {
         VkImage image;
-        VkDeviceMemory memory;
+        Allocation memory;
         VkImageView view;
     } depthImage;
 
-    VkSemaphore imageAvailableSemaphore;
-    VkSemaphore renderFinishedSemaphore;
+    //Everything the CPU needs to record and submit one frame while the GPU is still
+    //working on the previous ones
+    struct FrameSyncData {
+        VkCommandBuffer command;
+        VkSemaphore imageAvailable;
+        VkSemaphore renderFinished;
+        VkFence inFlight;
+    };
+    const uint32_t m_frames_in_flight;
+    uint32_t m_current_frame{0};
+    std::vector<FrameSyncData> m_frames;
+    std::vector<VkFence> m_images_in_flight;
 
     std::map<std::string, RenderObject> loadedObjects;
+    //The loaded object of every node, found without its name when the node moves
+    std::unordered_map<const BaseNode *, RenderObject *> m_node_objects;
     std::map<std::string, LightObject> loadedLights;
 
+    //Objects with the same geometry or material content share the GPU resources, keyed by the content hash.
+    //The asset the entry was created from tells another content with the same hash apart, see sharedKey
+    struct SharedGeometry {
+        std::shared_ptr<const Geometry> source;
+        GeometryBuffer geometry;
+        Bounds bounds;
+        uint32_t users{0};
+    };
+    struct SharedMaterial {
+        std::shared_ptr<const Material> source;
+        Pipeline pipeline;
+        DescriptorSet set;
+        uint32_t users{0};
+    };
+    std::unordered_map<uint64_t, SharedGeometry> m_geometries;
+    std::unordered_map<uint64_t, SharedMaterial> m_materials;
+    //Images of the material sets, shared by the materials with the same texture content
+    TextureCache m_textures;
+    //Every sampler of the renderer, one per distinct state
+    SamplerCache m_samplers;
+
+    struct CameraUniform {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec4 position;
+    };
+
+    //Camera and model matrices of every object, one copy for every frame in flight.
+    //The whole set is bound once per pass and the draws index the transforms with firstInstance
+    struct FrameUniforms {
+        VkDescriptorSet set;
+
+        VkBuffer camera;
+        Allocation cameraMemory;
+
+        VkBuffer transforms;
+        Allocation transformsMemory;
+        uint32_t capacity{0};
+
+        //Transform slot of every instance of the recorded draws
+        VkBuffer instances;
+        Allocation instancesMemory;
+        uint32_t instanceCapacity{0};
+
+        //Slots changed since this copy was last written, queued[slot] is set while the slot is in the list
+        std::vector<uint32_t> changedSlots;
+        std::vector<uint8_t> queued;
+    };
+    std::vector<FrameUniforms> m_frame_uniforms;
+
+    //CPU copy of the model matrices, kept dense: the object at slot i owns m_transforms[i].
+    //m_transform_versions[i] is the transform version of the node when its matrix was copied
+    std::vector<glm::mat4> m_transforms;
+    std::vector<uint32_t> m_transform_versions;
+    std::vector<RenderObject *> m_slot_owners;
+    //World space bounds of the object at slot i, moved with its transform
+    std::vector<Bounds> m_world_bounds;
+    //Hierarchy over the world bounds, m_bvh_leaves[i] is the leaf of slot i and the leaf value is the slot
+    BVH m_bvh;
+    std::vector<uint32_t> m_bvh_leaves;
+    //Slots visible in every view by the last culling, sorted. View 0 is the camera and view i + 1 the light i
+    std::vector<std::vector<uint32_t>> m_visible_slots;
+    //Matrices written by the last updateUniforms
+    uint32_t m_uploaded_transforms{0};
+    //CPU side mesh and image data freed after its upload, over the lifetime of the renderer
+    size_t m_released_bytes{0};
+
     VkDescriptorSetLayout objectLayout;
     VkDescriptorSetLayout materialLayout;
     VkDescriptorSetLayout shadowMapLayout;
@@ -84,6 +211,10 @@ private:
     const CameraNode *activeCamera = nullptr;
 
     std::vector<VkDescriptorPool> descriptorPools;
+    //Whether setLights created the shadow maps and their pipeline
+    bool m_shadow_maps_created{false};
+    //Pool every set was allocated from, the sets of destroyed materials go back to it
+    std::unordered_map<VkDescriptorSet, VkDescriptorPool> m_set_pools;
 
     VkPipelineLayout lightsPipelineLayout;
     VkShaderModule vshader;
@@ -94,7 +225,7 @@ private:
     const uint32_t shadowMapHeight = 2048;
     VkDescriptorSet shadowMapSet;
     VkBuffer lightMatrixBuffer;
-    VkDeviceMemory lightMatrixMemory;
+    Allocation lightMatrixMemory;
 
     VkDescriptorPool guiPool;
 
@@ -106,6 +237,7 @@ private:
 
     struct FrameLocalData {
         VkCommandBuffer command;
+        uint32_t frame_index;
         uint32_t image_index;
 
         VkImageView image_view;
@@ -118,24 +250,40 @@ private:
     const uint32_t version = VK_MAKE_VERSION(1, 0, 0);
 
 public:
-    explicit Renderer(const Window& window) {
-        createVulkanResources(window);
-        createDescriptorPools(5);
-
-        //Every object has the same layout since every object has the same descriptor types and numbers
-        const auto archetypes = ObjectNode::getObjectSetArchetype();
-        objectLayout = createDescriptorSetLayoutForUniformSet(archetypes.at("object"));
-        materialLayout = createDescriptorSetLayoutForUniformSet(archetypes.at("material"));
-
-        createComputePipeline();
+    //framesInFlight is the number of frames the CPU can record ahead of the GPU,
+    //every frame in flight has its own command buffer, synchronization objects and object uniforms
+    explicit Renderer(const Window& window, const uint32_t framesInFlight = 2) :
+            m_headless(false),
+            m_frames_in_flight(framesInFlight) {
+        const auto window_size = window.getWindowSize();
+        createVulkanResources(&window, {static_cast<uint32_t>(window_size.x), static_cast<uint32_t>(window_size.y)});
+        createRendererResources();
 
         initImguiInstance(window);
     }
 
+    //Headless renderer, draws into offscreen images of the given size, needs no display
+    //and no presentation support from the driver
+    explicit Renderer(const VkExtent2D extent, const uint32_t framesInFlight = 2) :
+            m_headless(true),
+            m_frames_in_flight(framesInFlight) {
+        createVulkanResources(nullptr, extent);
+        createRendererResources();
+    }
+
     void setCamera(const CameraNode *camera) {
         activeCamera = camera;
     }
 
+    const RenderStats &stats() const {
+        return m_stats;
+    }
+
+    //Idle outside of render, the scene update can run on the same threads
+    ThreadPool &workers() {
+        return m_workers;
+    }
+
     void load(const std::vector<ObjectNode *> &toLoad) {
 
         std::vector<ObjectNode *> notAlreadyLoadedObjects;
@@ -148,59 +296,99 @@ public:
             return;
         }
 
-        std::vector<Geometry> geometries;
-        std::vector<Material> materials;
-        geometries.reserve(notAlreadyLoadedObjects.size());
-        materials.reserve(notAlreadyLoadedObjects.size());
-
-        std::for_each(notAlreadyLoadedObjects.begin(), notAlreadyLoadedObjects.end(),
-                      [&geometries](const auto &o) { geometries.push_back(o->getGeometry()); });
-        std::for_each(notAlreadyLoadedObjects.begin(), notAlreadyLoadedObjects.end(),
-                      [&materials](const auto &o) { materials.push_back(o->getMaterial()); });
-
-        auto geom = createGeometries(geometries);
-
-        std::vector<UniformSet> objectSets;
-        objectSets.reserve(notAlreadyLoadedObjects.size());
-        std::vector<UniformSet> materialSets;
-        materialSets.reserve(notAlreadyLoadedObjects.size());
-
-        std::for_each(notAlreadyLoadedObjects.begin(), notAlreadyLoadedObjects.end(), [&](const auto object) {
-            auto sets = object->getUniformSets();
-            objectSets.push_back(sets["object"]);
-            materialSets.push_back(sets["material"]);
-        });
+        //Only the geometries and materials not loaded yet by some other object get GPU resources
+        std::vector<uint64_t> geometryKeys;
+        std::vector<uint64_t> newGeometryKeys;
+        //The assets are read in place, nothing is copied before the upload
+        std::vector<const Geometry *> geometries;
+        for (const auto object : notAlreadyLoadedObjects) {
+            const auto [geometryKey, inserted] = sharedKey(m_geometries, object->getGeometry());
+            geometryKeys.push_back(geometryKey);
+            if (inserted) {
+                newGeometryKeys.push_back(geometryKey);
+                geometries.push_back(object->getGeometry().get());
+            }
+        }
 
-        std::vector<VkDescriptorSetLayout> layouts(notAlreadyLoadedObjects.size());
-        std::fill(layouts.begin(), layouts.end(), objectLayout);
-        const auto objectDescriptorSets = allocateDescriptorSetsFromDescriptorPools(layouts);
-        std::fill(layouts.begin(), layouts.end(), materialLayout);
-        const auto materialDescriptorSets = allocateDescriptorSetsFromDescriptorPools(layouts);
+        if (!geometries.empty()) {
+            const auto geom = createGeometries(geometries);
+            size_t released = 0;
+            for (uint32_t i = 0; i < geom.size(); ++i) {
+                m_geometries[newGeometryKeys[i]].geometry = geom[i];
+                m_geometries[newGeometryKeys[i]].bounds = geometries[i]->bounds();
+                //The upload copied the data, the geometries whose residency allows it free theirs
+                if (geometries[i]->resident()->release()) {
+                    released += geometries[i]->byteSize();
+                }
+            }
+            logReleased("geometry", released);
+        }
 
-        auto mats = createPipelines(materials, {objectLayout, materialLayout, shadowMapLayout});
+        std::vector<uint64_t> newMaterialKeys;
+        const std::vector<uint64_t> materialKeys = createSharedMaterials(notAlreadyLoadedObjects, newMaterialKeys);
 
         for (int i = 0; i < notAlreadyLoadedObjects.size(); ++i) {
             Logger::log("loaded: " + notAlreadyLoadedObjects[i]->name() + "\n");
-            loadedObjects.insert({
+            auto &geometry = m_geometries.at(geometryKeys[i]);
+            auto &material = m_materials.at(materialKeys[i]);
+            ++geometry.users;
+            ++material.users;
+            auto [it, inserted] = loadedObjects.insert({
                                          notAlreadyLoadedObjects[i]->name(),
                                          RenderObject{
                                                  notAlreadyLoadedObjects[i],
-                                                 geom[i],
-                                                 {{0, initDescriptorSet(objectDescriptorSets[i], objectSets[i])},
-                                                  {1, initDescriptorSet(materialDescriptorSets[i], materialSets[i])}},
-                                                 mats[i],
+                                                 geometry.geometry,
+                                                 {{1, material.set}},
+                                                 static_cast<uint32_t>(m_transforms.size()),
+                                                 material.pipeline,
+                                                 geometryKeys[i],
+                                                 materialKeys[i],
+                                                 geometry.bounds,
                                          }});
+            m_transforms.push_back(notAlreadyLoadedObjects[i]->modelMatrix());
+            m_world_bounds.push_back(geometry.bounds.transformed(m_transforms.back()));
+            m_bvh_leaves.push_back(m_bvh.insert(m_world_bounds.back(), it->second.slot));
+            m_transform_versions.push_back(notAlreadyLoadedObjects[i]->transformVersion());
+            m_slot_owners.push_back(&it->second);
+            m_node_objects[notAlreadyLoadedObjects[i]] = &it->second;
         }
 
-        const DeviceContext context{m_pdevice, m_device, m_queue_info.graphics, m_queue_info.graphicsFamilyindex};
-        for (auto& [name, object] : loadedObjects) {
-            for(auto& [key, value] : object.descriptors){
-                updateAllUniforms(context, value);
+        //The new objects take the slots past the old ones, the frames in flight do not read them: only a frame whose
+        //buffer is too small waits for the GPU, it gets a new buffer written in full
+        const uint32_t firstNewSlot = m_transforms.size() - notAlreadyLoadedObjects.size();
+        for (uint32_t i = 0; i < m_frame_uniforms.size(); ++i) {
+            auto& frame = m_frame_uniforms[i];
+            if (frame.capacity >= m_transforms.size()) {
+                continue;
             }
+            waitForFrame(m_frames[i]);
+            resizeTransformBuffer(frame, std::max<uint32_t>(m_transforms.size(), frame.capacity * 2));
+            m_allocator.write(frame.transformsMemory, m_transforms.data(), m_transforms.size() * sizeof(glm::mat4));
+            //Everything was just written
+            for (const auto slot : frame.changedSlots) {
+                frame.queued[slot] = 0;
+            }
+            frame.changedSlots.clear();
+            frame.queued.resize(frame.capacity, 0);
+        }
+        for (uint32_t slot = firstNewSlot; slot < m_transforms.size(); ++slot) {
+            transformChanged(slot);
         }
+        ++m_structure_version;
     }
 
+    //Create the shadow maps of the lights, replacing the ones of the lights set before. The shadow map layout
+    //depends on the number of lights, the pipelines of the loaded materials are created again for the new one
     void setLights(const std::vector<LightNode *> &lights) {
+        if (m_shadow_maps_created || !m_materials.empty()) {
+            //The frames in flight can still read the old shadow maps and material pipelines
+            vkDeviceWaitIdle(m_device);
+        }
+        if (m_shadow_maps_created) {
+            destroyShadowMaps();
+        }
+        m_shadow_maps_created = true;
+
         shadowMapLayout = createShadowMapDescriptorLayout(lights.size());
         shadowMapSet = createShadowMapDescriptorSet(shadowMapLayout, lights.size());
 
@@ -223,20 +411,20 @@ public:
         info.mipLodBias = 0.0f;
         info.minLod = 0.0f;
         info.maxLod = 0.0f;
-        vkCreateSampler(m_device, &info, nullptr, &commonImageSampler);
+        commonImageSampler = m_samplers.get(deviceContext(), info);
 
-        glm::mat4 matrices[3];
+        std::vector<glm::mat4> matrices(lights.size());
 
         VkFormat depthFormat = Utils::findDepthFormat(m_pdevice);
         uint32_t index = 0;
         for (auto &light : lights) {
             Image map{};
-            Utils::createImage(m_pdevice, m_device, map.image, map.imagememory,
+            Utils::createImage(m_device, map.image,
                                {shadowMapWidth, shadowMapHeight}, depthFormat,
                                VK_IMAGE_TILING_OPTIMAL,
                                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
-                               VK_IMAGE_USAGE_SAMPLED_BIT,
-                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+                               VK_IMAGE_USAGE_SAMPLED_BIT);
+            map.imagememory = m_allocator.allocateForImage(map.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
             Utils::createImageView(m_device, map.imageview, map.image, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
             map.sampler = commonImageSampler;
             loadedLights.emplace(light->name(), LightObject{light, map});
@@ -272,52 +460,235 @@ public:
                                        vshader,
                                        {shadowMapWidth, shadowMapHeight});
 
-        const uint32_t buffer_size = sizeof(glm::mat4) * 3;
+        const uint32_t buffer_size = sizeof(glm::mat4) * lights.size();
         const uint32_t nOfLights = lights.size();
-        Utils::copyToMemory(m_device, lightMatrixMemory, matrices, buffer_size, 0);
-        Utils::copyToMemory(m_device, lightMatrixMemory, &nOfLights, sizeof(uint32_t), buffer_size);
+        if (buffer_size > 0) {
+            m_allocator.write(lightMatrixMemory, matrices.data(), buffer_size);
+        }
+        m_allocator.write(lightMatrixMemory, &nOfLights, sizeof(uint32_t), buffer_size);
+
+        if (!m_materials.empty()) {
+            recreateMaterialPipelines();
+        }
+        ++m_structure_version;
     }
 
+    //Writes the camera and the model matrices of the current frame, the GPU must have finished
+    //the last frame that used them before they can be overwritten
     void updateUniforms() {
-        const DeviceContext context{m_pdevice, m_device, m_queue_info.graphics, m_queue_info.graphicsFamilyindex};
-        for (auto&[key, object] : loadedObjects) {
-            if (object.node->toUpdate()) {
-                //Update object uniform
-                matrices m{};
-                m.model = object.node->modelMatrix();
-                m.view = activeCamera->getViewMatrix();
-                m.projection = activeCamera->getProjectionMatrix();
-                glm::vec3 cameraPosition = glm::vec3(glm::vec4(0.0, 0.0, 0.0, 1.0) * activeCamera->modelMatrix());
-
-                Utils::copyToMemory(m_device, object.descriptors[0].uniform_memory, &m.model, sizeof(glm::mat4), object.descriptors[0].buffersForSlot[0].offset);
-                Utils::copyToMemory(m_device, object.descriptors[0].uniform_memory, &m.view, sizeof(glm::mat4), object.descriptors[0].buffersForSlot[1].offset);
-                Utils::copyToMemory(m_device, object.descriptors[0].uniform_memory, &m.projection, sizeof(glm::mat4), object.descriptors[0].buffersForSlot[2].offset);
-                Utils::copyToMemory(m_device, object.descriptors[0].uniform_memory, &cameraPosition, sizeof(glm::vec3), object.descriptors[0].buffersForSlot[3].offset);
-
-                object.node->updated();
-            }
-        }
+        waitForFrame(m_frames[m_current_frame]);
+
+        auto& frame = m_frame_uniforms[m_current_frame];
+
+        const glm::vec3 cameraPosition = glm::vec3(glm::vec4(0.0, 0.0, 0.0, 1.0) * activeCamera->modelMatrix());
+        const CameraUniform camera{
+                activeCamera->getViewMatrix(),
+                activeCamera->getProjectionMatrix(),
+                glm::vec4(cameraPosition, 1.0)
+        };
+        m_allocator.write(frame.cameraMemory, &camera, sizeof(CameraUniform));
+
+        uploadChangedTransforms(frame);
+    }
+
+    uint32_t uploadedTransforms() const {
+        return m_uploaded_transforms;
+    }
+
+    size_t releasedBytes() const {
+        return m_released_bytes;
+    }
+
+    const TextureCache &textures() const {
+        return m_textures;
     }
 
     void unload(const std::vector<std::string> &namesOfObjectsToUnload) {
-        const DeviceContext context{m_pdevice, m_device, m_queue_info.graphics, m_queue_info.graphicsFamilyindex};
+        const DeviceContext context = deviceContext();
 
+        //The frames in flight can still reference the resources of the objects
+        vkDeviceWaitIdle(m_device);
         for (const auto &objectName: namesOfObjectsToUnload) {
-            destroy(context, loadedObjects[objectName]);
+            if (!loadedObjects.contains(objectName)) {
+                continue;
+            }
+            const RenderObject &object = loadedObjects.at(objectName);
+            releaseSlot(object.slot);
+            releaseGeometry(context, object.geometry_key);
+            releaseMaterial(context, object.material_key);
+            m_node_objects.erase(object.node);
             loadedObjects.erase(objectName);
             Logger::log("unloaded: " + objectName + " \n");
         }
+        ++m_structure_version;
+    }
+
+    //Give new materials to loaded objects, the materials no object uses anymore are destroyed
+    void changeMaterials(const std::vector<ObjectNode *> &toChange) {
+        std::vector<ObjectNode *> loaded;
+        std::copy_if(toChange.begin(), toChange.end(),
+                     std::back_inserter(loaded),
+                     [&](const auto &object) {
+                         return loadedObjects.contains(object->name());
+                     });
+        if (loaded.empty()) {
+            return;
+        }
+
+        //The frames in flight can still use the old pipelines and sets
+        vkDeviceWaitIdle(m_device);
+        std::vector<uint64_t> newMaterialKeys;
+        const std::vector<uint64_t> materialKeys = createSharedMaterials(loaded, newMaterialKeys);
+
+        const DeviceContext context = deviceContext();
+        for (uint32_t i = 0; i < loaded.size(); ++i) {
+            RenderObject &object = loadedObjects.at(loaded[i]->name());
+            auto &material = m_materials.at(materialKeys[i]);
+            ++material.users;
+            releaseMaterial(context, object.material_key);
+            object.descriptors[1] = material.set;
+            object.pipeline = material.pipeline;
+            object.material_key = materialKeys[i];
+        }
+        ++m_structure_version;
+    }
+
+    //Apply the changes of the scene since the last call in their order, the cost depends on what changed and
+    //not on the size of the scene. Call it after updateTransforms, the moved objects get their new matrices here
+    void apply(SceneRegistry &registry) {
+        const SceneJournal journal = registry.takeJournal();
+        if (journal.empty()) {
+            return;
+        }
+
+        //The material pipelines are made with the shadow map layout of the lights, so the lights are set before the
+        //objects are loaded, also when the journal adds the objects first. The camera and the lights are read from
+        //the registry as they are now, setting them first gives the same result as setting them in order
+        bool camera = false;
+        bool lights = false;
+        bool objects = false;
+        for (const auto &event : journal.events()) {
+            if (!event.forgotten) {
+                camera |= event.type == SceneEventType::CameraChanged;
+                lights |= event.type == SceneEventType::LightsChanged;
+                objects |= event.type == SceneEventType::ObjectAdded;
+            }
+        }
+        if (camera) {
+            setCamera(registry.activeCamera());
+        }
+        if (lights || (objects && !m_shadow_maps_created)) {
+            setLights(registry.lights());
+        }
+
+        //Consecutive events of the same type are applied together, a load or unload waits for the device once
+        std::vector<ObjectNode *> added;
+        std::vector<std::string> removed;
+        std::vector<ObjectNode *> restyled;
+        const auto flush = [&]() {
+            if (!removed.empty()) {
+                unload(removed);
+                removed.clear();
+            }
+            if (!added.empty()) {
+                load(added);
+                added.clear();
+            }
+            if (!restyled.empty()) {
+                changeMaterials(restyled);
+                restyled.clear();
+            }
+        };
+
+        for (const auto &event : journal.events()) {
+            if (event.forgotten) {
+                continue;
+            }
+            if ((event.type != SceneEventType::ObjectAdded && !added.empty()) ||
+                (event.type != SceneEventType::ObjectRemoved && !removed.empty()) ||
+                (event.type != SceneEventType::MaterialChanged && !restyled.empty())) {
+                flush();
+            }
+
+            switch (event.type) {
+                case SceneEventType::ObjectAdded:
+                    added.push_back(static_cast<ObjectNode *>(event.node));
+                    break;
+                case SceneEventType::ObjectRemoved:
+                    removed.push_back(event.name);
+                    break;
+                case SceneEventType::MaterialChanged:
+                    restyled.push_back(static_cast<ObjectNode *>(event.node));
+                    break;
+                case SceneEventType::TransformChanged:
+                    //The subtree of a moved ancestor contains this one, it is walked once
+                    if (!ancestorMoved(journal, event.node)) {
+                        updateSubtreeTransforms(event.node);
+                    }
+                    break;
+                case SceneEventType::CameraChanged:
+                case SceneEventType::LightsChanged:
+                    //Applied before the other events
+                    break;
+            }
+        }
+        flush();
+    }
+
+    //Closest object whose bounds the ray origin + t * direction hits, nullptr when there is none
+    ObjectNode *pick(const glm::vec3 &origin, const glm::vec3 &direction, const float maxDistance = 1000.0f) const {
+        const RenderObject *closest = nullptr;
+        float closestDistance = maxDistance;
+        const glm::vec3 inverseDirection = 1.0f / direction;
+        m_bvh.raycast(origin, direction, maxDistance, [&](const uint32_t slot, float) {
+            float distance;
+            if (m_world_bounds[slot].intersects(origin, inverseDirection, closestDistance, distance)) {
+                closest = m_slot_owners[slot];
+                closestDistance = distance;
+            }
+        });
+        return closest ? closest->node : nullptr;
+    }
+
+    //Object under a point of the screen, x and y go from 0 to 1 from the top left corner
+    ObjectNode *pick(const glm::vec2 &screenPosition) const {
+        if (!activeCamera) {
+            return nullptr;
+        }
+        //The projection flips y, so the top of the screen is -1 in clip space as in Vulkan.
+        //The ray goes from the camera through the point on the far plane
+        const glm::mat4 inverse = glm::inverse(activeCamera->getProjectionMatrix() * activeCamera->getViewMatrix());
+        const glm::vec2 ndc = screenPosition * 2.0f - 1.0f;
+        const glm::vec4 farPoint = inverse * glm::vec4(ndc, 1.0f, 1.0f);
+        const glm::vec3 origin = activeCamera->modelMatrix()[3];
+        return pick(origin, glm::normalize(glm::vec3(farPoint) / farPoint.w - origin));
     }
 
     void render() {
+        FrameSyncData& frame = m_frames[m_current_frame];
+        waitForFrame(frame);
+
         FrameLocalData frameData{};
-        vkAcquireNextImageKHR(m_device,
-                              m_swapchain_data.swapchain,
-                              UINT64_MAX,
-                              imageAvailableSemaphore,
-                              VK_NULL_HANDLE,
-                              &frameData.image_index);
-        frameData.command = m_commands.buffers[frameData.image_index];
+        if (m_headless) {
+            //There is one offscreen image for every frame in flight so the frame fence also guards the image
+            frameData.image_index = m_current_frame;
+        } else {
+            vkAcquireNextImageKHR(m_device,
+                                  m_swapchain_data.swapchain,
+                                  UINT64_MAX,
+                                  frame.imageAvailable,
+                                  VK_NULL_HANDLE,
+                                  &frameData.image_index);
+        }
+
+        //The swapchain can hand back an image that an older frame is still rendering to
+        if (m_images_in_flight[frameData.image_index] != VK_NULL_HANDLE) {
+            vkWaitForFences(m_device, 1, &m_images_in_flight[frameData.image_index], VK_TRUE, UINT64_MAX);
+        }
+        m_images_in_flight[frameData.image_index] = frame.inFlight;
+
+        frameData.command = frame.command;
+        frameData.frame_index = m_current_frame;
         frameData.image_view = m_swapchain_data.views[frameData.image_index];
         frameData.framebuffer = m_swapchain_data.framebuffers[frameData.image_index];
 
@@ -338,21 +709,30 @@ public:
             throw std::runtime_error("failed to end recording command buffer!");
         }
 
-        VkSemaphore waitSemaphores[] = {imageAvailableSemaphore};
+        VkSemaphore waitSemaphores[] = {frame.imageAvailable};
         VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-        VkSemaphore signalSemaphores[] = {renderFinishedSemaphore};
+        VkSemaphore signalSemaphores[] = {frame.renderFinished};
 
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.waitSemaphoreCount = m_headless ? 0 : 1;
         submitInfo.pWaitSemaphores = waitSemaphores;
         submitInfo.pWaitDstStageMask = waitStages;
         submitInfo.commandBufferCount = 1;
         submitInfo.pCommandBuffers = &frameData.command;
-        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.signalSemaphoreCount = m_headless ? 0 : 1;
         submitInfo.pSignalSemaphores = signalSemaphores;
 
-        vkQueueSubmit(m_queue_info.graphics, 1, &submitInfo, VK_NULL_HANDLE);
+        vkResetFences(m_device, 1, &frame.inFlight);
+        if (vkQueueSubmit(m_queue_info.graphics, 1, &submitInfo, frame.inFlight) != VK_SUCCESS) {
+            throw std::runtime_error("failed to submit draw command buffer!");
+        }
+
+        m_last_image_index = frameData.image_index;
+        if (m_headless) {
+            m_current_frame = (m_current_frame + 1) % m_frames_in_flight;
+            return;
+        }
 
         VkSwapchainKHR swapchains[] = {m_swapchain_data.swapchain};
         VkPresentInfoKHR presentInfo{};
@@ -365,25 +745,143 @@ public:
         presentInfo.pResults = nullptr;
         vkQueuePresentKHR(m_queue_info.graphics, &presentInfo);
 
+        m_current_frame = (m_current_frame + 1) % m_frames_in_flight;
+    }
+
+    bool isHeadless() const {
+        return m_headless;
+    }
+
+    //Copy back the last rendered image (after post-processing) as tightly packed RGBA8 pixels,
+    //waits for the GPU to finish the frame
+    std::vector<unsigned char> readFrame() {
+        if (!m_headless) {
+            throw std::runtime_error("Frame readback is only available on a headless renderer");
+        }
+        vkDeviceWaitIdle(m_device);
+
+        const VkExtent2D extent = m_swapchain_data.extent;
+        const uint32_t data_size = extent.width * extent.height * 4;
+        const VkImage image = m_swapchain_data.images[m_last_image_index];
+
+        VkBuffer readbackBuffer;
+        Utils::createBuffer(m_device, readbackBuffer, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_SHARING_MODE_EXCLUSIVE, data_size);
+        const Allocation readbackMemory = m_allocator.allocateForBuffer(readbackBuffer,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+
+        VkCommandPool readbackPool{};
+        VkCommandBuffer command;
+
+        VkCommandPoolCreateInfo poolinfo{};
+        poolinfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolinfo.queueFamilyIndex = m_queue_info.graphicsFamilyindex;
+        if (vkCreateCommandPool(m_device, &poolinfo, nullptr, &readbackPool) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create command pool");
+        }
+
+        VkCommandBufferAllocateInfo commandBufferAllocateInfo{};
+        commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        commandBufferAllocateInfo.commandPool = readbackPool;
+        commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        commandBufferAllocateInfo.commandBufferCount = 1;
+        if (vkAllocateCommandBuffers(m_device, &commandBufferAllocateInfo, &command) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to allocate command buffers");
+        }
+
+        VkCommandBufferBeginInfo info{};
+        info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(command, &info);
+
+        VkImageMemoryBarrier toTransfer{};
+        toTransfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        toTransfer.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+        toTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        toTransfer.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        toTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        toTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        toTransfer.image = image;
+        toTransfer.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        vkCmdPipelineBarrier(command,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0,
+                             0, nullptr,
+                             0, nullptr,
+                             1, &toTransfer);
+
+        VkBufferImageCopy region{};
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = {0, 0, 0};
+        region.imageExtent = {extent.width, extent.height, 1};
+        vkCmdCopyImageToBuffer(command, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffer, 1, &region);
+
+        VkImageMemoryBarrier toGeneral = toTransfer;
+        toGeneral.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        toGeneral.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        toGeneral.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        toGeneral.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(command,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0,
+                             0, nullptr,
+                             0, nullptr,
+                             1, &toGeneral);
+
+        vkEndCommandBuffer(command);
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &command;
+        vkQueueSubmit(m_queue_info.graphics, 1, &submitInfo, VK_NULL_HANDLE);
         vkQueueWaitIdle(m_queue_info.graphics);
+
+        std::vector<unsigned char> pixels(data_size);
+        m_allocator.invalidate(readbackMemory);
+        memcpy(pixels.data(), readbackMemory.mapped, data_size);
+
+        vkDestroyCommandPool(m_device, readbackPool, nullptr);
+        vkDestroyBuffer(m_device, readbackBuffer, nullptr);
+        m_allocator.free(readbackMemory);
+
+        return pixels;
     }
 
     ~Renderer() {
         vkDeviceWaitIdle(m_device);
 
-        const DeviceContext context{m_pdevice, m_device, m_queue_info.graphics, m_queue_info.graphicsFamilyindex};
-        for (const auto&[key, object]: loadedObjects) {
-            destroy(context, object);
+        const DeviceContext context = deviceContext();
+        for (const auto&[key, geometry]: m_geometries) {
+            destroy(context, geometry.geometry);
         }
+        for (auto&[key, material]: m_materials) {
+            destroyMaterial(context, material);
+        }
+        m_textures.clear(context);
+        if (m_shadow_maps_created) {
+            destroyShadowMaps();
+        }
+        m_samplers.clear(context);
         for (auto &pool : descriptorPools) {
             vkDestroyDescriptorPool(m_device, pool, nullptr);
         }
+        for (auto &frame : m_frame_uniforms) {
+            vkDestroyBuffer(m_device, frame.camera, nullptr);
+            m_allocator.free(frame.cameraMemory);
+            vkDestroyBuffer(m_device, frame.transforms, nullptr);
+            m_allocator.free(frame.transformsMemory);
+            vkDestroyBuffer(m_device, frame.instances, nullptr);
+            m_allocator.free(frame.instancesMemory);
+        }
 
-        vkDestroySampler(m_device, render_targets.front().sampler, nullptr);
         for (auto& image : render_targets) {
             vkDestroyImage(m_device, image.image, nullptr);
             vkDestroyImageView(m_device, image.imageview, nullptr);
-            vkFreeMemory(m_device, image.imagememory, nullptr);
+            m_allocator.free(image.imagememory);
         }
 
         vkDestroyDescriptorSetLayout(m_device, computeDescriptorSetLayout, nullptr);
@@ -393,35 +891,27 @@ public:
 
         vkDestroyDescriptorSetLayout(m_device, objectLayout, nullptr);
         vkDestroyDescriptorSetLayout(m_device, materialLayout, nullptr);
-        vkDestroyShaderModule(m_device, vshader, nullptr);
-        vkDestroyPipelineLayout(m_device, lightsPipelineLayout, nullptr);
-        vkDestroyPipeline(m_device, lightsPipeline, nullptr);
-        vkDestroyDescriptorSetLayout(m_device, shadowMapLayout, nullptr);
-
-        vkDestroyBuffer(m_device, lightMatrixBuffer, nullptr);
-        vkFreeMemory(m_device, lightMatrixMemory, nullptr);
-
-        vkDestroySampler(m_device, commonImageSampler, nullptr);
 
-        for (const auto&[key, object]: loadedLights) {
-            vkDestroyImage(m_device, object.shadow_map.image, nullptr);
-            vkDestroyImageView(m_device, object.shadow_map.imageview, nullptr);
-            vkFreeMemory(m_device, object.shadow_map.imagememory, nullptr);
-            vkDestroyFramebuffer(m_device, object.framebuffer, nullptr);
+        for (auto &frame : m_frames) {
+            vkDestroySemaphore(m_device, frame.imageAvailable, nullptr);
+            vkDestroySemaphore(m_device, frame.renderFinished, nullptr);
+            vkDestroyFence(m_device, frame.inFlight, nullptr);
         }
 
-        vkDestroyRenderPass(m_device, fill_shadow_maps, nullptr);
-
-        vkDestroySemaphore(m_device, imageAvailableSemaphore, nullptr);
-        vkDestroySemaphore(m_device, renderFinishedSemaphore, nullptr);
+        if (!m_headless) {
+            ImGui_ImplVulkan_Shutdown();
+            ImGui_ImplGlfw_Shutdown();
+            ImGui::DestroyContext();
 
-        ImGui_ImplVulkan_Shutdown();
-        ImGui_ImplGlfw_Shutdown();
-        ImGui::DestroyContext();
-
-        vkDestroyDescriptorPool(m_device, guiPool, nullptr);
+            vkDestroyDescriptorPool(m_device, guiPool, nullptr);
+        }
 
         vkDestroyCommandPool(m_device, m_commands.pool, nullptr);
+        for (const auto &frameCommands : m_worker_commands) {
+            for (const auto &commands : frameCommands) {
+                vkDestroyCommandPool(m_device, commands.pool, nullptr);
+            }
+        }
         for (auto framebuffer : m_swapchain_data.framebuffers) {
             vkDestroyFramebuffer(m_device, framebuffer, nullptr);
         }
@@ -432,38 +922,345 @@ public:
 
         vkDestroyImageView(m_device, depthImage.view, nullptr);
         vkDestroyImage(m_device, depthImage.image, nullptr);
-        vkFreeMemory(m_device, depthImage.memory, nullptr);
+        m_allocator.free(depthImage.memory);
 
-        vkDestroySwapchainKHR(m_device, m_swapchain_data.swapchain, nullptr);
-        vkDestroySurfaceKHR(m_instance_data.instance, m_surface, nullptr);
+        //The views of the offscreen targets are the swapchain views and are already destroyed
+        for (auto& image : offscreen_targets) {
+            vkDestroyImage(m_device, image.image, nullptr);
+            m_allocator.free(image.imagememory);
+        }
+        m_allocator.destroy();
+
+        if (!m_headless) {
+            vkDestroySwapchainKHR(m_device, m_swapchain_data.swapchain, nullptr);
+            vkDestroySurfaceKHR(m_instance_data.instance, m_surface, nullptr);
+        }
         vkDestroyDevice(m_device, nullptr);
         vkDestroyInstance(m_instance_data.instance, nullptr);
     }
 
 private:
 
-    void createVulkanResources(const Window &window) {
+    void createRendererResources() {
+        createDescriptorPools(5);
+
+        //Every object has the same layout since every object has the same descriptor types and numbers
+        const auto archetypes = ObjectNode::getObjectSetArchetype();
+        objectLayout = createDescriptorSetLayoutForUniformSet(archetypes.at("object"));
+        materialLayout = createDescriptorSetLayoutForUniformSet(archetypes.at("material"));
+
+        createFrameUniforms();
+        createComputePipeline();
+    }
+
+    void createFrameUniforms() {
+        const std::vector<VkDescriptorSetLayout> layouts(m_frames_in_flight, objectLayout);
+        const auto sets = allocateDescriptorSetsFromDescriptorPools(layouts);
+
+        m_frame_uniforms.resize(m_frames_in_flight);
+        for (uint32_t i = 0; i < m_frames_in_flight; ++i) {
+            auto& frame = m_frame_uniforms[i];
+            frame.set = sets[i];
+
+            Utils::createBuffer(m_device, frame.camera, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                VK_SHARING_MODE_EXCLUSIVE, sizeof(CameraUniform));
+            frame.cameraMemory = m_allocator.allocateForBuffer(frame.camera, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+
+            VkDescriptorBufferInfo info{};
+            info.buffer = frame.camera;
+            info.offset = 0;
+            info.range = sizeof(CameraUniform);
+
+            VkWriteDescriptorSet dscWrite{};
+            dscWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            dscWrite.dstSet = frame.set;
+            dscWrite.dstBinding = 0;
+            dscWrite.dstArrayElement = 0;
+            dscWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            dscWrite.descriptorCount = 1;
+            dscWrite.pBufferInfo = &info;
+            vkUpdateDescriptorSets(m_device, 1, &dscWrite, 0, nullptr);
+
+            resizeTransformBuffer(frame, 64);
+            resizeInstanceBuffer(frame, 64);
+        }
+    }
+
+    //The set must not be in use by a frame in flight, the old content is lost
+    void resizeTransformBuffer(FrameUniforms& frame, const uint32_t capacity) {
+        recreateStorageBuffer(frame.set, 1, frame.transforms, frame.transformsMemory,
+                              frame.capacity > 0, capacity * sizeof(glm::mat4));
+        frame.capacity = capacity;
+    }
+    void resizeInstanceBuffer(FrameUniforms& frame, const uint32_t capacity) {
+        recreateStorageBuffer(frame.set, 2, frame.instances, frame.instancesMemory,
+                              frame.instanceCapacity > 0, capacity * sizeof(uint32_t));
+        frame.instanceCapacity = capacity;
+    }
+    //Host visible storage buffer bound to binding of the frame set, the old buffer is destroyed when it exists
+    void recreateStorageBuffer(const VkDescriptorSet set, const uint32_t binding,
+                               VkBuffer &buffer, Allocation &memory,
+                               const bool exists, const VkDeviceSize size) {
+        if (exists) {
+            vkDestroyBuffer(m_device, buffer, nullptr);
+            m_allocator.free(memory);
+        }
+
+        Utils::createBuffer(m_device, buffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                            VK_SHARING_MODE_EXCLUSIVE, size);
+        memory = m_allocator.allocateForBuffer(buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+
+        VkDescriptorBufferInfo info{};
+        info.buffer = buffer;
+        info.offset = 0;
+        info.range = VK_WHOLE_SIZE;
+
+        VkWriteDescriptorSet dscWrite{};
+        dscWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        dscWrite.dstSet = set;
+        dscWrite.dstBinding = binding;
+        dscWrite.dstArrayElement = 0;
+        dscWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        dscWrite.descriptorCount = 1;
+        dscWrite.pBufferInfo = &info;
+        vkUpdateDescriptorSets(m_device, 1, &dscWrite, 0, nullptr);
+    }
+
+    //Key of the entry sharing the content of asset, and whether it was added: an entry with only its source set,
+    //its GPU resources are created by the caller. The key is the hash of the asset, or the next free one when
+    //entries with the same hash hold a different content. A freed key may split such a run, the content past it
+    //then gets a second entry, it is never confused with another
+    template<typename Shared, typename Asset>
+    static std::pair<uint64_t, bool> sharedKey(std::unordered_map<uint64_t, Shared> &shared,
+                                               const std::shared_ptr<const Asset> &asset) {
+        for (uint64_t key = asset->hash();; ++key) {
+            auto [entry, inserted] = shared.try_emplace(key);
+            if (inserted) {
+                entry->second.source = asset;
+                return {key, true};
+            }
+            if (entry->second.source->sameContent(*asset)) {
+                return {key, false};
+            }
+        }
+    }
+
+    //Key of the material of every object, the pipelines and sets of the ones not loaded yet are created, filled
+    //and their keys added to newKeys. The users are not counted here
+    std::vector<uint64_t> createSharedMaterials(const std::vector<ObjectNode *> &objects, std::vector<uint64_t> &newKeys) {
+        std::vector<uint64_t> keys;
+        std::vector<const Material *> materials;
+        for (const auto object : objects) {
+            const auto [key, inserted] = sharedKey(m_materials, object->getMaterial());
+            keys.push_back(key);
+            if (inserted) {
+                newKeys.push_back(key);
+                materials.push_back(object->getMaterial().get());
+            }
+        }
+
+        if (!materials.empty()) {
+            const std::vector<VkDescriptorSetLayout> layouts(materials.size(), materialLayout);
+            const auto materialDescriptorSets = allocateDescriptorSetsFromDescriptorPools(layouts);
+            const auto mats = createPipelines(materials, {objectLayout, materialLayout, shadowMapLayout});
+            const DeviceContext context = deviceContext();
+            size_t released = 0;
+            for (uint32_t i = 0; i < mats.size(); ++i) {
+                auto &material = m_materials[newKeys[i]];
+                material.pipeline = mats[i];
+                material.set = initDescriptorSet(materialDescriptorSets[i], *materials[i]->uniforms());
+                //The images come from the texture cache, uploaded by the first material using them
+                updateBufferUniforms(context, material.set);
+
+                if (materials[i]->residency() != Residency::Keep) {
+                    //The set shares the image data with the material, both let go of it
+                    for (auto &[slot, uniform] : material.set.uniforms) {
+                        if (uniform.type == TYPE_IMAGE) {
+                            uniform.data.reset();
+                        }
+                    }
+                    const size_t bytes = materials[i]->imageByteSize();
+                    if (materials[i]->resident()->release()) {
+                        released += bytes;
+                    }
+                }
+            }
+            logReleased("image", released);
+        }
+        return keys;
+    }
+
+    void logReleased(const std::string &kind, const size_t bytes) {
+        if (bytes == 0) {
+            return;
+        }
+        m_released_bytes += bytes;
+        Logger::log("released " + std::to_string(bytes) + " bytes of " + kind + " data after the upload, " +
+                    std::to_string(m_released_bytes) + " in total\n");
+    }
+
+    //Drop one user of a shared resource, the last one destroys it
+    void releaseGeometry(const DeviceContext &context, const uint64_t key) {
+        auto geometry = m_geometries.find(key);
+        if (--geometry->second.users == 0) {
+            destroy(context, geometry->second.geometry);
+            m_geometries.erase(geometry);
+        }
+    }
+    void releaseMaterial(const DeviceContext &context, const uint64_t key) {
+        auto material = m_materials.find(key);
+        if (--material->second.users == 0) {
+            destroyMaterial(context, material->second);
+            m_materials.erase(material);
+        }
+    }
+    //The images go back to the texture cache, the last material using one destroys it
+    void destroyMaterial(const DeviceContext &context, SharedMaterial &material) {
+        for (const auto &[slot, image] : material.set.imagesForSlot) {
+            m_textures.release(context, image);
+        }
+        material.set.imagesForSlot.clear();
+        destroy(context, material.set);
+        freeDescriptorSet(material.set.set);
+        destroy(context, material.pipeline);
+    }
+
+    //The world matrices of every node below a moved one changed, the loaded objects among them are copied
+    void updateSubtreeTransforms(BaseNode *moved) {
+        thread_local std::vector<BaseNode *> stack;
+        stack.push_back(moved);
+        while (!stack.empty()) {
+            BaseNode *node = stack.back();
+            stack.pop_back();
+            const auto found = m_node_objects.find(node);
+            if (found != m_node_objects.end()) {
+                const uint32_t slot = found->second->slot;
+                const uint32_t version = node->transformVersion();
+                if (m_transform_versions[slot] != version) {
+                    m_transforms[slot] = node->modelMatrix();
+                    m_transform_versions[slot] = version;
+                    m_world_bounds[slot] = found->second->bounds.transformed(m_transforms[slot]);
+                    m_bvh.update(m_bvh_leaves[slot], m_world_bounds[slot]);
+                    transformChanged(slot);
+                }
+            }
+            for (const auto &child : node->children()) {
+                stack.push_back(child.get());
+            }
+        }
+    }
+
+    static bool ancestorMoved(const SceneJournal &journal, const BaseNode *node) {
+        for (const BaseNode *ancestor = node->parent(); ancestor; ancestor = ancestor->parent()) {
+            if (journal.moved(ancestor)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //The copy of every frame in flight has to be written again
+    void transformChanged(const uint32_t slot) {
+        for (auto& frame : m_frame_uniforms) {
+            if (!frame.queued[slot]) {
+                frame.queued[slot] = 1;
+                frame.changedSlots.push_back(slot);
+            }
+        }
+    }
+
+    //Write the slots changed since the last time this copy was written, runs of consecutive slots in one write
+    void uploadChangedTransforms(FrameUniforms& frame) {
+        auto& slots = frame.changedSlots;
+        std::sort(slots.begin(), slots.end());
+
+        const uint32_t size = m_transforms.size();
+        m_uploaded_transforms = 0;
+        for (uint32_t i = 0; i < slots.size();) {
+            const uint32_t first = slots[i];
+            uint32_t end = first;
+            while (i < slots.size() && slots[i] == end) {
+                frame.queued[end] = 0;
+                ++end;
+                ++i;
+            }
+            //Slots past the end were released after they changed
+            end = std::min(end, size);
+            if (first < end) {
+                m_allocator.write(frame.transformsMemory, m_transforms.data() + first,
+                                  (end - first) * sizeof(glm::mat4), first * sizeof(glm::mat4));
+                m_uploaded_transforms += end - first;
+            }
+        }
+        slots.clear();
+    }
+
+    //Keep the transforms dense: the last slot is moved into the released one
+    void releaseSlot(const uint32_t slot) {
+        const uint32_t last = m_transforms.size() - 1;
+        m_bvh.remove(m_bvh_leaves[slot]);
+        if (slot != last) {
+            m_bvh_leaves[slot] = m_bvh_leaves[last];
+            m_bvh.setValue(m_bvh_leaves[slot], slot);
+            m_transforms[slot] = m_transforms[last];
+            m_transform_versions[slot] = m_transform_versions[last];
+            m_world_bounds[slot] = m_world_bounds[last];
+            m_slot_owners[slot] = m_slot_owners[last];
+            m_slot_owners[slot]->slot = slot;
+            transformChanged(slot);
+        }
+        m_transforms.pop_back();
+        m_transform_versions.pop_back();
+        m_world_bounds.pop_back();
+        m_bvh_leaves.pop_back();
+        m_slot_owners.pop_back();
+    }
+
+    //Without a window the surface and the swapchain are replaced by offscreen images of the given extent
+    void createVulkanResources(const Window *window, const VkExtent2D extent) {
+        if (m_frames_in_flight == 0) {
+            throw std::runtime_error("At least one frame in flight is needed");
+        }
+
         VkApplicationInfo appinfo{VK_STRUCTURE_TYPE_APPLICATION_INFO};
         appinfo.pApplicationName = appName.c_str();
         appinfo.pEngineName = engineName.c_str();
         appinfo.apiVersion = version;
 
         uint32_t windowSystemExtensionCount = 0;
-        const char **windowSystemExtensions = glfwGetRequiredInstanceExtensions(&windowSystemExtensionCount);
+        const char **windowSystemExtensions = nullptr;
+        if (window != nullptr) {
+            windowSystemExtensions = glfwGetRequiredInstanceExtensions(&windowSystemExtensionCount);
+        }
+
+        uint32_t availableLayerCount = 0;
+        vkEnumerateInstanceLayerProperties(&availableLayerCount, nullptr);
+        std::vector<VkLayerProperties> availableLayers(availableLayerCount);
+        vkEnumerateInstanceLayerProperties(&availableLayerCount, availableLayers.data());
+        for (auto layer: m_instance_data.validation_layers) {
+            const bool available = std::any_of(availableLayers.begin(), availableLayers.end(), [&](const auto &props) {
+                return std::string(props.layerName) == layer;
+            });
+            if (available) {
+                m_instance_data.enabled_layers.push_back(layer);
+            } else {
+                Logger::log("Layer " + std::string(layer) + " not available, skipping it\n");
+            }
+        }
 
         VkInstanceCreateInfo instanceinfo{VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO};
         instanceinfo.pApplicationInfo = &appinfo;
         instanceinfo.enabledExtensionCount = windowSystemExtensionCount;
         instanceinfo.ppEnabledExtensionNames = windowSystemExtensions;
-        instanceinfo.enabledLayerCount = static_cast<uint32_t>(m_instance_data.validation_layers.size());
-        instanceinfo.ppEnabledLayerNames = m_instance_data.validation_layers.data();
+        instanceinfo.enabledLayerCount = static_cast<uint32_t>(m_instance_data.enabled_layers.size());
+        instanceinfo.ppEnabledLayerNames = m_instance_data.enabled_layers.data();
 
         Logger::log("Enabled " + std::to_string(windowSystemExtensionCount) + " extensions for window system\n");
         for (int i = 0; i < windowSystemExtensionCount; ++i) {
             Logger::log("\t" + std::string(windowSystemExtensions[i]) + "\n");
         }
-        Logger::log("Enabled " + std::to_string(m_instance_data.validation_layers.size()) + " layers\n");
-        for (auto layer: m_instance_data.validation_layers) {
+        Logger::log("Enabled " + std::to_string(m_instance_data.enabled_layers.size()) + " layers\n");
+        for (auto layer: m_instance_data.enabled_layers) {
             Logger::log("\t" + std::string(layer) + "\n");
         };
 
@@ -532,16 +1329,19 @@ private:
         deviceinfo.queueCreateInfoCount = queueCreateInfos.size();
         deviceinfo.pQueueCreateInfos = queueCreateInfos.data();
         deviceinfo.pEnabledFeatures = &device_features;
-        deviceinfo.enabledExtensionCount = static_cast<uint32_t>(m_instance_data.device_layers.size());
+        //Without presentation there is no need for the swapchain extension
+        deviceinfo.enabledExtensionCount = m_headless ? 0 : static_cast<uint32_t>(m_instance_data.device_layers.size());
         deviceinfo.ppEnabledExtensionNames = m_instance_data.device_layers.data();
-        deviceinfo.enabledLayerCount = static_cast<uint32_t>(m_instance_data.validation_layers.size());
-        deviceinfo.ppEnabledLayerNames = m_instance_data.validation_layers.data();
+        deviceinfo.enabledLayerCount = static_cast<uint32_t>(m_instance_data.enabled_layers.size());
+        deviceinfo.ppEnabledLayerNames = m_instance_data.enabled_layers.data();
 
 
         if (vkCreateDevice(m_pdevice, &deviceinfo, nullptr, &m_device)) {
             throw std::runtime_error("Logical device creation failed");
         }
 
+        m_allocator.init(m_pdevice, m_device);
+
         vkGetDeviceQueue(m_device, m_queue_info.graphicsFamilyindex, m_queue_info.graphicsQueueIndex,
                          &m_queue_info.graphics);
         vkGetDeviceQueue(m_device, m_queue_info.transferFamilyindex, m_queue_info.transferQueueIndex,
@@ -549,37 +1349,14 @@ private:
         vkGetDeviceQueue(m_device, m_queue_info.computeFamilyindex, m_queue_info.computeQueueIndex,
                          &m_queue_info.compute);
 
-        if (glfwCreateWindowSurface(m_instance_data.instance, window.getWindowHandle(), nullptr, &m_surface) !=
-            VK_SUCCESS) {
-            throw std::runtime_error("Surface creation failed");
-        }
-
-        auto window_size = window.getWindowSize();
-        m_swapchain_data.extent = {
-                static_cast<uint32_t>(window_size.x),
-                static_cast<uint32_t>(window_size.y)
-        };
-
-        SurfaceParams surface_params{};
-        createSwapchain(m_pdevice, m_device, m_surface,
-                        m_swapchain_data.swapchain,
-                        m_queue_info.graphicsFamilyindex,
-                        m_swapchain_data.extent,
-                        surface_params);
-
-        vkGetSwapchainImagesKHR(m_device,
-                                m_swapchain_data.swapchain,
-                                &m_swapchain_data.nImages,
-                                nullptr);
+        m_swapchain_data.extent = extent;
 
-        m_swapchain_data.images.resize(m_swapchain_data.nImages);
-        m_swapchain_data.views.resize(m_swapchain_data.nImages);
-        m_swapchain_data.framebuffers.resize(m_swapchain_data.nImages);
-
-        vkGetSwapchainImagesKHR(m_device,
-                                m_swapchain_data.swapchain,
-                                &m_swapchain_data.nImages,
-                                m_swapchain_data.images.data());
+        VkFormat colorFormat;
+        if (window != nullptr) {
+            colorFormat = createSwapchainImages(*window);
+        } else {
+            colorFormat = createOffscreenImages();
+        }
 
         VkSampler commonRenderTargetSampler{};
         VkSamplerCreateInfo info{};
@@ -599,20 +1376,20 @@ private:
         info.mipLodBias = 0.0f;
         info.minLod = 0.0f;
         info.maxLod = 0.0f;
-        vkCreateSampler(m_device, &info, nullptr, &commonRenderTargetSampler);
+        commonRenderTargetSampler = m_samplers.get(deviceContext(), info);
 
         render_targets.resize(m_swapchain_data.nImages);
 
         for (int i = 0; i < m_swapchain_data.nImages; ++i) {
             Image image{};
-            Utils::createImage(m_pdevice, m_device, image.image, image.imagememory,
+            Utils::createImage(m_device, image.image,
                                m_swapchain_data.extent,
-                               surface_params.format.format,
+                               colorFormat,
                                VK_IMAGE_TILING_OPTIMAL,
-                               VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+                               VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+            image.imagememory = m_allocator.allocateForImage(image.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
             Utils::createImageView(m_device, image.imageview, image.image,
-                                   surface_params.format.format,
+                                   colorFormat,
                                    VK_IMAGE_ASPECT_COLOR_BIT);
             image.sampler = commonRenderTargetSampler; //Every image must have a sampler to feed it into the compute shader
             render_targets[i] = image;
@@ -620,19 +1397,18 @@ private:
             Utils::createImageView(m_device,
                                    m_swapchain_data.views[i],
                                    m_swapchain_data.images[i],
-                                   surface_params.format.format,
+                                   colorFormat,
                                    VK_IMAGE_ASPECT_COLOR_BIT);
         }
 
         VkFormat depthFormat = Utils::findDepthFormat(m_pdevice);
-        Utils::createImage(m_pdevice, m_device,
+        Utils::createImage(m_device,
                            depthImage.image,
-                           depthImage.memory,
                            m_swapchain_data.extent,
                            depthFormat,
                            VK_IMAGE_TILING_OPTIMAL,
-                           VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+                           VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
+        depthImage.memory = m_allocator.allocateForImage(depthImage.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
         Utils::createImageView(m_device,
                                depthImage.view,
                                depthImage.image,
@@ -642,7 +1418,7 @@ private:
         createRenderPass(m_render_pass, m_pdevice, m_device,
                          m_swapchain_data.extent,
                          depthFormat,
-                         surface_params.format.format,
+                         colorFormat,
                          VK_IMAGE_LAYOUT_UNDEFINED,
                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
@@ -661,16 +1437,71 @@ private:
         createCommandBuffers(m_device,
                              m_commands.pool,
                              m_commands.buffers,
-                             m_swapchain_data.nImages,
+                             m_frames_in_flight,
                              m_queue_info.graphicsFamilyindex,
                              VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
 
-        VkSemaphoreCreateInfo semInfo{VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
-        vkCreateSemaphore(m_device, &semInfo, nullptr, &imageAvailableSemaphore);
-        vkCreateSemaphore(m_device, &semInfo, nullptr, &renderFinishedSemaphore);
+        createFrameSyncObjects();
+        createWorkerCommandPools();
 
     }
 
+    VkFormat createSwapchainImages(const Window &window) {
+        if (glfwCreateWindowSurface(m_instance_data.instance, window.getWindowHandle(), nullptr, &m_surface) !=
+            VK_SUCCESS) {
+            throw std::runtime_error("Surface creation failed");
+        }
+
+        SurfaceParams surface_params{};
+        createSwapchain(m_pdevice, m_device, m_surface,
+                        m_swapchain_data.swapchain,
+                        m_queue_info.graphicsFamilyindex,
+                        m_swapchain_data.extent,
+                        surface_params);
+
+        vkGetSwapchainImagesKHR(m_device,
+                                m_swapchain_data.swapchain,
+                                &m_swapchain_data.nImages,
+                                nullptr);
+
+        m_swapchain_data.images.resize(m_swapchain_data.nImages);
+        m_swapchain_data.views.resize(m_swapchain_data.nImages);
+        m_swapchain_data.framebuffers.resize(m_swapchain_data.nImages);
+
+        vkGetSwapchainImagesKHR(m_device,
+                                m_swapchain_data.swapchain,
+                                &m_swapchain_data.nImages,
+                                m_swapchain_data.images.data());
+
+        return surface_params.format.format;
+    }
+
+    //Offscreen images that the post-processing writes into in place of the swapchain images,
+    //one for every frame in flight
+    VkFormat createOffscreenImages() {
+        const VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+
+        m_swapchain_data.nImages = m_frames_in_flight;
+        m_swapchain_data.images.resize(m_swapchain_data.nImages);
+        m_swapchain_data.views.resize(m_swapchain_data.nImages);
+        m_swapchain_data.framebuffers.resize(m_swapchain_data.nImages);
+        offscreen_targets.resize(m_swapchain_data.nImages);
+
+        for (int i = 0; i < m_swapchain_data.nImages; ++i) {
+            Utils::createImage(m_device,
+                               offscreen_targets[i].image,
+                               m_swapchain_data.extent,
+                               format,
+                               VK_IMAGE_TILING_OPTIMAL,
+                               VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+            offscreen_targets[i].imagememory = m_allocator.allocateForImage(offscreen_targets[i].image,
+                                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+            m_swapchain_data.images[i] = offscreen_targets[i].image;
+        }
+
+        return format;
+    }
+
     void createSwapchain(const VkPhysicalDevice &pdevice,
                          const VkDevice &device,
                          const VkSurfaceKHR &surface,
@@ -762,11 +1593,13 @@ private:
         VkSubpassDependency dependency{};
         dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
         dependency.dstSubpass = 0;
+        //The depth buffer is shared by all the frames in flight so the previous frame depth writes must be done
         dependency.srcStageMask =
-                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
         dependency.dstStageMask =
                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-        dependency.srcAccessMask = 0;
+        dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
         dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
         std::array<VkAttachmentDescription, 2> attachments{colorAttachment, depthAttachment};
@@ -817,8 +1650,10 @@ private:
         VkSubpassDependency dependency{};
         dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
         dependency.dstSubpass = 0;
+        //The shadow maps must not be overwritten while the previous frame is still sampling them
         dependency.srcStageMask =
-                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
         dependency.srcAccessMask = 0;
         dependency.dstStageMask =
                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
@@ -889,9 +1724,51 @@ private:
 
     }
 
-    //Create descriptor pools for different uniform types
+    void createFrameSyncObjects() {
+        m_frames.resize(m_frames_in_flight);
+        m_images_in_flight.assign(m_swapchain_data.nImages, VK_NULL_HANDLE);
+
+        VkSemaphoreCreateInfo semInfo{VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+        //Created signaled so that the first wait on every frame returns immediately
+        VkFenceCreateInfo fenceInfo{VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+        for (int i = 0; i < m_frames_in_flight; ++i) {
+            m_frames[i].command = m_commands.buffers[i];
+            if (vkCreateSemaphore(m_device, &semInfo, nullptr, &m_frames[i].imageAvailable) != VK_SUCCESS ||
+                vkCreateSemaphore(m_device, &semInfo, nullptr, &m_frames[i].renderFinished) != VK_SUCCESS ||
+                vkCreateFence(m_device, &fenceInfo, nullptr, &m_frames[i].inFlight) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to create frame synchronization objects");
+            }
+        }
+    }
+
+    void createWorkerCommandPools() {
+        VkCommandPoolCreateInfo poolinfo{};
+        poolinfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolinfo.queueFamilyIndex = m_queue_info.graphicsFamilyindex;
+        poolinfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+        m_recordings.resize(m_frames_in_flight);
+        m_worker_commands.resize(m_frames_in_flight);
+        for (auto &frameCommands : m_worker_commands) {
+            frameCommands.resize(m_workers.size());
+            for (auto &commands : frameCommands) {
+                if (vkCreateCommandPool(m_device, &poolinfo, nullptr, &commands.pool) != VK_SUCCESS) {
+                    throw std::runtime_error("Failed to create command pool");
+                }
+            }
+        }
+    }
+
+    void waitForFrame(const FrameSyncData& frame) {
+        vkWaitForFences(m_device, 1, &frame.inFlight, VK_TRUE, UINT64_MAX);
+    }
+
+    //Create descriptor pools for different uniform types. Their sets can be freed one by one, so loading and
+    //unloading objects does not use them up
     void createDescriptorPools(const int nOfPools) {
-        descriptorPools.reserve(nOfPools);
+        descriptorPools.reserve(descriptorPools.size() + nOfPools);
         for (int i = 0; i < nOfPools; ++i) {
 
             const std::array<VkDescriptorPoolSize, 4> poolSizes{{
@@ -906,7 +1783,7 @@ private:
             pInfo.poolSizeCount = poolSizes.size();
             pInfo.pPoolSizes = poolSizes.data();
             pInfo.maxSets = 64;
-            pInfo.flags = 0;
+            pInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
 
             auto &pool = descriptorPools.emplace_back();
             if (vkCreateDescriptorPool(m_device, &pInfo, nullptr, &pool) != VK_SUCCESS) {
@@ -915,21 +1792,25 @@ private:
         }
     }
 
-    std::vector<GeometryBuffer> createGeometries(const std::vector<Geometry> &geometries) {
-        const DeviceContext context{m_pdevice, m_device, m_queue_info.graphics, m_queue_info.graphicsFamilyindex};
+    DeviceContext deviceContext() {
+        return DeviceContext{m_pdevice, m_device, m_queue_info.graphics, m_queue_info.graphicsFamilyindex, m_allocator};
+    }
+
+    std::vector<GeometryBuffer> createGeometries(const std::vector<const Geometry *> &geometries) {
+        const DeviceContext context = deviceContext();
         return createBuffers(context, geometries);
     }
 
-    std::vector<Pipeline> createPipelines(const std::vector<Material> &materials,
+    std::vector<Pipeline> createPipelines(const std::vector<const Material *> &materials,
                                           const std::vector<VkDescriptorSetLayout> &acceptedLayouts) {
-        const DeviceContext context{m_pdevice, m_device, m_queue_info.graphics, m_queue_info.graphicsFamilyindex};
+        const DeviceContext context = deviceContext();
 
         std::vector<Pipeline> result;
         result.reserve(materials.size());
 
-        for (auto& material : materials) {
+        for (const auto material : materials) {
             result.emplace_back(createPipeline(context,
-                                            material,
+                                            *material,
                                             acceptedLayouts,
                                             m_render_pass,
                                             m_swapchain_data.extent));
@@ -950,6 +1831,9 @@ private:
             if (uniform.type == TYPE_BUFFER) {
                 binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
             }
+            if (uniform.type == TYPE_STORAGE_BUFFER) {
+                binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            }
             if (uniform.type == TYPE_IMAGE || uniform.type == TYPE_CUBEMAP) {
                 binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
             }
@@ -968,24 +1852,91 @@ private:
     //Allocate the descriptor sets for every layout
     std::vector<VkDescriptorSet> allocateDescriptorSetsFromDescriptorPools(const std::vector<VkDescriptorSetLayout> &layouts) {
         std::vector<VkDescriptorSet> allocatedDescriptorSets(layouts.size());
-        for (const auto &descriptorPool : descriptorPools) {
+        const auto allocateFrom = [&](const VkDescriptorPool descriptorPool) {
             VkDescriptorSetAllocateInfo allocationInfo{};
             allocationInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
             allocationInfo.descriptorPool = descriptorPool;
             allocationInfo.descriptorSetCount = layouts.size();
             allocationInfo.pSetLayouts = layouts.data();
+            if (vkAllocateDescriptorSets(m_device, &allocationInfo, allocatedDescriptorSets.data()) != VK_SUCCESS) {
+                return false;
+            }
+            for (const auto set : allocatedDescriptorSets) {
+                m_set_pools[set] = descriptorPool;
+            }
+            return true;
+        };
 
-            //If the allocation is successfull then return the allocated sets otherwise check the next
-            //available pool
-            if (vkAllocateDescriptorSets(m_device, &allocationInfo, allocatedDescriptorSets.data()) == VK_SUCCESS) {
+        //If the allocation is successfull then return the allocated sets otherwise check the next
+        //available pool
+        for (const auto &descriptorPool : descriptorPools) {
+            if (allocateFrom(descriptorPool)) {
                 return allocatedDescriptorSets;
             }
         }
 
-        //If no pool has been able to accomodate the allocation request then
+        //Every pool is full, one more is made
+        createDescriptorPools(1);
+        if (allocateFrom(descriptorPools.back())) {
+            return allocatedDescriptorSets;
+        }
+
+        //If not even an empty pool can accomodate the allocation request then
         //no creation of new sets is possible
         throw std::runtime_error("Not enough pool space to initialize layouts");
     }
+
+    //Destroy what setLights created, the device must be done with it
+    void destroyShadowMaps() {
+        for (const auto&[key, object]: loadedLights) {
+            vkDestroyImage(m_device, object.shadow_map.image, nullptr);
+            vkDestroyImageView(m_device, object.shadow_map.imageview, nullptr);
+            m_allocator.free(object.shadow_map.imagememory);
+            vkDestroyFramebuffer(m_device, object.framebuffer, nullptr);
+        }
+        loadedLights.clear();
+
+        vkDestroyRenderPass(m_device, fill_shadow_maps, nullptr);
+        vkDestroyShaderModule(m_device, vshader, nullptr);
+        vkDestroyPipelineLayout(m_device, lightsPipelineLayout, nullptr);
+        vkDestroyPipeline(m_device, lightsPipeline, nullptr);
+
+        freeDescriptorSet(shadowMapSet);
+        vkDestroyDescriptorSetLayout(m_device, shadowMapLayout, nullptr);
+        vkDestroyBuffer(m_device, lightMatrixBuffer, nullptr);
+        m_allocator.free(lightMatrixMemory);
+    }
+
+    //The pipelines of the loaded materials were made with the previous shadow map layout. They are built from the
+    //material each entry was created from: a node may already hold a new material whose change is not applied yet
+    void recreateMaterialPipelines() {
+        const DeviceContext context = deviceContext();
+        std::vector<const Material *> sources;
+        sources.reserve(m_materials.size());
+        for (auto &[key, material] : m_materials) {
+            destroy(context, material.pipeline);
+            sources.push_back(material.source.get());
+        }
+        const auto pipelines = createPipelines(sources, {objectLayout, materialLayout, shadowMapLayout});
+        uint32_t index = 0;
+        for (auto &[key, material] : m_materials) {
+            material.pipeline = pipelines[index++];
+        }
+        //Objects hold a copy of the pipeline of their material
+        for (const auto object : m_slot_owners) {
+            object->pipeline = m_materials.at(object->material_key).pipeline;
+        }
+    }
+
+    //Give a set back to its pool, the device must be done with it
+    void freeDescriptorSet(const VkDescriptorSet set) {
+        const auto pool = m_set_pools.find(set);
+        if (pool == m_set_pools.end()) {
+            return;
+        }
+        vkFreeDescriptorSets(m_device, pool->second, 1, &set);
+        m_set_pools.erase(pool);
+    }
     //Init the descriptor set with data from uniformSet
     DescriptorSet initDescriptorSet(const VkDescriptorSet& descriptorSet, const UniformSet &uniformSet) {
         DescriptorSet descriptor{};
@@ -1004,18 +1955,11 @@ private:
                                 VK_SHARING_MODE_EXCLUSIVE,
                                 total_uniform_size);
 
-            total_uniform_size = Utils::allocateDeviceMemory(m_pdevice, m_device,
-                                                             descriptor.uniform_buffer, descriptor.uniform_memory,
-                                                             total_uniform_size,
-                                                             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                                             VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-            vkBindBufferMemory(m_device,
-                               descriptor.uniform_buffer,
-                               descriptor.uniform_memory,
-                               uniform_offset);
+            descriptor.uniform_memory = m_allocator.allocateForBuffer(descriptor.uniform_buffer,
+                                                             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
         } else {
             descriptor.uniform_buffer = VK_NULL_HANDLE;
-            descriptor.uniform_memory = VK_NULL_HANDLE;
+            descriptor.uniform_memory = {};
         }
 
         for (const auto&[slot, uniform] : descriptor.uniforms) {
@@ -1043,9 +1987,9 @@ private:
                 vkUpdateDescriptorSets(m_device, 1, &dscWrite, 0, nullptr);
             }
             if (uniform.type == TYPE_IMAGE) {
-                const DeviceContext context{m_pdevice, m_device, m_queue_info.graphics,
-                                            m_queue_info.graphicsFamilyindex};
-                descriptor.imagesForSlot[slot] = createImage(context, {uniform.size[0], uniform.size[1]});
+                const DeviceContext context = deviceContext();
+                descriptor.imagesForSlot[slot] = m_textures.acquire(context, uniform);
+                descriptor.imagesForSlot[slot].sampler = m_samplers.get(context, uniform.sampler);
 
                 VkDescriptorImageInfo image_info{};
                 image_info.imageView = descriptor.imagesForSlot[slot].imageview;
@@ -1103,12 +2047,7 @@ private:
                 VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
                 VK_SHARING_MODE_EXCLUSIVE,
                 buffer_size + sizeof(uint32_t));
-        Utils::allocateDeviceMemory(m_pdevice, m_device,
-                lightMatrixBuffer,
-                lightMatrixMemory,
-                buffer_size + sizeof(uint32_t),
-                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-        vkBindBufferMemory(m_device, lightMatrixBuffer, lightMatrixMemory, 0);
+        lightMatrixMemory = m_allocator.allocateForBuffer(lightMatrixBuffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
 
         for (int i = 0; i < nOfLights; ++i) {
             VkDescriptorBufferInfo bInfoMatrixArray{};
@@ -1332,6 +2271,296 @@ private:
         glm::mat4 projection;
     };
 
+    //Next free secondary command buffer of the worker, more are allocated when all of them are in use
+    VkCommandBuffer acquireSecondary(WorkerCommands &commands) {
+        if (commands.used == commands.secondaries.size()) {
+            VkCommandBufferAllocateInfo allocateInfo{};
+            allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocateInfo.commandPool = commands.pool;
+            allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            allocateInfo.commandBufferCount = 1;
+
+            VkCommandBuffer secondary;
+            if (vkAllocateCommandBuffers(m_device, &allocateInfo, &secondary) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to allocate command buffers");
+            }
+            commands.secondaries.push_back(secondary);
+        }
+        return commands.secondaries[commands.used++];
+    }
+
+    //Secondary that continues the subpass 0 of renderPass, it is executed again every frame until the
+    //structure changes so the framebuffer can be left VK_NULL_HANDLE when it changes between executions
+    VkCommandBuffer beginSecondary(WorkerCommands &commands, const VkRenderPass renderPass, const VkFramebuffer framebuffer) {
+        VkCommandBuffer secondary = acquireSecondary(commands);
+
+        VkCommandBufferInheritanceInfo inheritanceInfo{};
+        inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inheritanceInfo.renderPass = renderPass;
+        inheritanceInfo.subpass = 0;
+        inheritanceInfo.framebuffer = framebuffer;
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        beginInfo.pInheritanceInfo = &inheritanceInfo;
+        if (vkBeginCommandBuffer(secondary, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin recording command buffer!");
+        }
+        return secondary;
+    }
+
+    //Draws objects [begin, end) into the shadow map of light
+    //Every draw of the shadow pass of a light uses the same pipeline and push constants,
+    //only the geometry changes and it is bound only when it differs from the previous draw
+    void recordShadowDraws(VkCommandBuffer command,
+                           const FrameLocalData &frame_data,
+                           const LightObject &light,
+                           const DrawList &drawList,
+                           RenderStats &stats) {
+        if (drawList.items.empty()) {
+            return;
+        }
+
+        vkCmdBindPipeline(command,
+                          VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          lightsPipeline);
+        ++stats.pipelineBinds;
+
+        //Set 0 is the same for every object, it stays bound across pipelines with compatible layouts
+        const VkDescriptorSet frameSet = m_frame_uniforms[frame_data.frame_index].set;
+        vkCmdBindDescriptorSets(command,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                lightsPipelineLayout,
+                                0, 1,
+                                &frameSet,
+                                0, nullptr);
+        ++stats.descriptorBinds;
+
+        OInfo lightInfo{
+                light.node->getViewMatrix(),
+                light.node->getProjectionMatrix()
+        };
+        vkCmdPushConstants(command, lightsPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                           sizeof(OInfo), &lightInfo);
+
+        const GeometryBuffer *bound = nullptr;
+        for (const auto &item : drawList.items) {
+            const GeometryBuffer &geometry = item.object->geometry;
+            bindGeometry(command, geometry, bound, stats);
+            bound = &geometry;
+
+            vkCmdDrawIndexed(command,
+                             geometry.n_of_indices,
+                             item.nOfInstances,
+                             0,
+                             0,
+                             item.firstInstance);
+            ++stats.draws;
+            stats.instances += item.nOfInstances;
+        }
+    }
+
+    //Draws [begin, end) of the sorted draw list in the main pass, state equal to the previous draw is not bound again
+    void recordMainDraws(VkCommandBuffer command,
+                         const FrameLocalData &frame_data,
+                         const DrawList &drawList,
+                         const uint32_t begin,
+                         const uint32_t end,
+                         RenderStats &stats) {
+        const VkDescriptorSet frameSet = m_frame_uniforms[frame_data.frame_index].set;
+
+        const DrawItem *previous = nullptr;
+        for (uint32_t i = begin; i < end; ++i) {
+            const DrawItem &item = drawList.items[i];
+            const RenderObject &object = *item.object;
+
+            const bool samePipeline = previous && previous->object->pipeline.pipeline == object.pipeline.pipeline;
+            const bool sameLayout = previous && previous->object->pipeline.pipeline_layout == object.pipeline.pipeline_layout;
+            if (!samePipeline) {
+                vkCmdBindPipeline(command,
+                                  VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                  object.pipeline.pipeline);
+                ++stats.pipelineBinds;
+            }
+
+            //Pipelines with a different layout may disturb set 0
+            if (!sameLayout) {
+                vkCmdBindDescriptorSets(command,
+                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                        object.pipeline.pipeline_layout,
+                                        0, 1,
+                                        &frameSet,
+                                        0, nullptr);
+                ++stats.descriptorBinds;
+            }
+
+            const auto sets = drawList.sets.begin() + item.firstSet;
+            const bool sameSets = sameLayout && previous->nOfSets == item.nOfSets &&
+                                  std::equal(sets, sets + item.nOfSets, drawList.sets.begin() + previous->firstSet);
+            if (!sameSets) {
+                vkCmdBindDescriptorSets(command,
+                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                        object.pipeline.pipeline_layout,
+                                        1, item.nOfSets,
+                                        &*sets,
+                                        0, nullptr);
+                ++stats.descriptorBinds;
+            }
+
+            bindGeometry(command, object.geometry, previous ? &previous->object->geometry : nullptr, stats);
+
+            vkCmdDrawIndexed(command,
+                             object.geometry.n_of_indices,
+                             item.nOfInstances,
+                             0,
+                             0,
+                             item.firstInstance);
+            ++stats.draws;
+            stats.instances += item.nOfInstances;
+            previous = &item;
+        }
+    }
+
+    void bindGeometry(VkCommandBuffer command, const GeometryBuffer &geometry, const GeometryBuffer *bound, RenderStats &stats) {
+        if (!bound || bound->buffer != geometry.buffer || bound->vertices_offset != geometry.vertices_offset) {
+            VkDeviceSize offsets[1] = {geometry.vertices_offset};
+            vkCmdBindVertexBuffers(command,
+                                   0, 1,
+                                   &geometry.buffer,
+                                   offsets);
+            ++stats.vertexBufferBinds;
+        }
+        if (!bound || bound->buffer != geometry.buffer || bound->indices_offset != geometry.indices_offset) {
+            vkCmdBindIndexBuffer(command,
+                                 geometry.buffer,
+                                 geometry.indices_offset,
+                                 VK_INDEX_TYPE_UINT32);
+            ++stats.indexBufferBinds;
+        }
+    }
+
+    //Find the objects in the view of the camera and of every light, the result is in m_visible_slots.
+    //Only the parts of the hierarchy that reach into a view are visited, the objects found are tested with
+    //their exact bounds. Returns a hash of the result, equal hashes mean the same objects are drawn in every view
+    uint64_t cull(const std::vector<const LightObject *> &lights) {
+        m_visible_slots.resize(lights.size() + 1);
+        const auto collect = [&](const glm::mat4 &viewProjection, std::vector<uint32_t> &visible) {
+            const Frustum frustum(viewProjection);
+            visible.clear();
+            m_bvh.query(frustum, [&](const uint32_t slot) {
+                if (frustum.intersects(m_world_bounds[slot])) {
+                    visible.push_back(slot);
+                }
+            });
+            //The order of the hierarchy changes when objects move, the order of the slots does not
+            std::sort(visible.begin(), visible.end());
+        };
+
+        if (activeCamera) {
+            collect(activeCamera->getProjectionMatrix() * activeCamera->getViewMatrix(), m_visible_slots[0]);
+        } else {
+            m_visible_slots[0].resize(m_transforms.size());
+            std::iota(m_visible_slots[0].begin(), m_visible_slots[0].end(), 0);
+        }
+        for (uint32_t i = 0; i < lights.size(); ++i) {
+            collect(lights[i]->node->getProjectionMatrix() * lights[i]->node->getViewMatrix(), m_visible_slots[i + 1]);
+        }
+
+        uint64_t hash = hashValue(m_transforms.size());
+        for (const auto &visible : m_visible_slots) {
+            hash = hashValue(visible.size(), hash);
+            hash = hashBytes(visible.data(), visible.size() * sizeof(uint32_t), hash);
+        }
+        return hash;
+    }
+
+    //Record all the secondaries of a frame in flight again, the fence of the frame must have been waited
+    void recordSecondaries(FrameRecording &recording,
+                           const FrameLocalData &frame_data,
+                           const VkRenderPass &render_pass,
+                           const std::vector<const LightObject *> &lights) {
+        auto &workerCommands = m_worker_commands[frame_data.frame_index];
+        for (auto &commands : workerCommands) {
+            vkResetCommandPool(m_device, commands.pool, 0);
+            commands.used = 0;
+        }
+
+        //A draw list for the camera and one for every light, with the objects of that view only.
+        //Their instances share the instance buffer, the lists after the first are offset past the previous ones
+        const glm::vec3 cameraPosition = activeCamera ? glm::vec3(activeCamera->modelMatrix()[3]) : glm::vec3(0.0f);
+        std::vector<DrawList> drawLists;
+        drawLists.reserve(m_visible_slots.size());
+        std::vector<uint32_t> instances;
+        std::vector<const RenderObject *> objects;
+        for (const auto &visible : m_visible_slots) {
+            objects.clear();
+            for (const auto slot : visible) {
+                objects.push_back(m_slot_owners[slot]);
+            }
+            DrawList list = buildDrawList(objects, shadowMapSet, cameraPosition);
+            const uint32_t offset = instances.size();
+            for (auto &item : list.items) {
+                item.firstInstance += offset;
+            }
+            instances.insert(instances.end(), list.instances.begin(), list.instances.end());
+            drawLists.push_back(std::move(list));
+        }
+        const DrawList &drawList = drawLists[0];
+        const uint32_t nOfDraws = drawList.items.size();
+
+        //The instance buffer of the frame is read only by the command buffers recorded here
+        auto &frame = m_frame_uniforms[frame_data.frame_index];
+        if (frame.instanceCapacity < instances.size()) {
+            resizeInstanceBuffer(frame, std::max<uint32_t>(instances.size(), frame.instanceCapacity * 2));
+        }
+        if (!instances.empty()) {
+            m_allocator.write(frame.instancesMemory, instances.data(), instances.size() * sizeof(uint32_t));
+        }
+
+        //One secondary for every shadow pass and the main pass split in chunks, one chunk per worker at most
+        const uint32_t nOfChunks = nOfDraws == 0 ? 0 :
+                std::clamp<uint32_t>((nOfDraws + minDrawsPerChunk - 1) / minDrawsPerChunk, 1, m_workers.size());
+        auto &shadowCommands = recording.shadowCommands;
+        auto &mainCommands = recording.mainCommands;
+        shadowCommands.assign(lights.size(), VK_NULL_HANDLE);
+        mainCommands.assign(nOfChunks, VK_NULL_HANDLE);
+        //Every task counts into its own stats, they are summed once all of them are done
+        std::vector<RenderStats> taskStats(lights.size() + nOfChunks);
+
+        std::vector<ThreadPool::Task> tasks;
+        tasks.reserve(lights.size() + nOfChunks);
+        for (uint32_t i = 0; i < lights.size(); ++i) {
+            tasks.emplace_back([&, i](const uint32_t worker) {
+                shadowCommands[i] = beginSecondary(workerCommands[worker], fill_shadow_maps, lights[i]->framebuffer);
+                recordShadowDraws(shadowCommands[i], frame_data, *lights[i], drawLists[i + 1], taskStats[i]);
+                vkEndCommandBuffer(shadowCommands[i]);
+            });
+        }
+        for (uint32_t i = 0; i < nOfChunks; ++i) {
+            const uint32_t begin = i * nOfDraws / nOfChunks;
+            const uint32_t end = (i + 1) * nOfDraws / nOfChunks;
+            tasks.emplace_back([&, i, begin, end](const uint32_t worker) {
+                //The swapchain image, and so the framebuffer, is not known until the frame is rendered
+                mainCommands[i] = beginSecondary(workerCommands[worker], render_pass, VK_NULL_HANDLE);
+                recordMainDraws(mainCommands[i], frame_data, drawList, begin, end, taskStats[lights.size() + i]);
+                vkEndCommandBuffer(mainCommands[i]);
+            });
+        }
+        m_workers.run(tasks);
+
+        recording.stats = {};
+        for (const auto &stats : taskStats) {
+            recording.stats += stats;
+        }
+        recording.stats.visibleObjects = instances.size();
+        recording.stats.culledObjects = drawLists.size() * loadedObjects.size() - instances.size();
+        Logger::log("recorded " + std::to_string(recording.stats.draws) + " draws of " +
+                    std::to_string(recording.stats.instances) + " instances with " +
+                    std::to_string(recording.stats.binds()) + " binds, " +
+                    std::to_string(recording.stats.culledObjects) + " objects culled\n");
+    }
+
     void recordCommandsInto(VkCommandBuffer &command,
                             const FrameLocalData &frame_data,
                             const SwapchainInfo &swapchain_info,
@@ -1340,59 +2569,44 @@ private:
         constexpr std::array<VkClearValue, 2> clearVals{{{0.0f, 0.0f, 0.0f, 0.0f}, {1.0f, 0.0f}}};
         constexpr std::array<VkClearValue, 1> depthClearVals{{{1.0f, 0.0f}}};
 
+        std::vector<const LightObject *> lights;
+        lights.reserve(loadedLights.size());
+        std::vector<glm::mat4> lightMatrices;
+        lightMatrices.reserve(loadedLights.size() * 2);
+        for (const auto&[name, light] : loadedLights) {
+            lights.push_back(&light);
+            lightMatrices.push_back(light.node->getViewMatrix());
+            lightMatrices.push_back(light.node->getProjectionMatrix());
+        }
+
+        const uint64_t visibility = cull(lights);
+
+        auto &recording = m_recordings[frame_data.frame_index];
+        if (recording.version != m_structure_version || recording.lightMatrices != lightMatrices ||
+            recording.visibility != visibility) {
+            recordSecondaries(recording, frame_data, render_pass, lights);
+            recording.version = m_structure_version;
+            recording.lightMatrices = std::move(lightMatrices);
+            recording.visibility = visibility;
+        }
+        const auto &shadowCommands = recording.shadowCommands;
+        const auto &mainCommands = recording.mainCommands;
+        m_stats = recording.stats;
+
         //Render to the shadowmaps
-        for (const auto& [name, light] : loadedLights) {
+        for (uint32_t i = 0; i < lights.size(); ++i) {
 
             VkRenderPassBeginInfo render_to_target_info{};
             render_to_target_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
             render_to_target_info.renderPass = fill_shadow_maps;
-            render_to_target_info.framebuffer = light.framebuffer;
+            render_to_target_info.framebuffer = lights[i]->framebuffer;
             render_to_target_info.renderArea.offset = {0, 0};
             render_to_target_info.renderArea.extent = {shadowMapWidth, shadowMapHeight};
             render_to_target_info.clearValueCount = depthClearVals.size();
             render_to_target_info.pClearValues = depthClearVals.data();
 
-            vkCmdBeginRenderPass(command, &render_to_target_info, VK_SUBPASS_CONTENTS_INLINE);
-
-            for (const auto&[name, object]  : loadedObjects) {
-
-                vkCmdBindPipeline(command,
-                                  VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                  lightsPipeline);
-
-                OInfo objectInfo{
-                        light.node->getViewMatrix(),
-                        light.node->getProjectionMatrix()
-                };
-                vkCmdPushConstants(command, object.pipeline.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0,
-                                   sizeof(OInfo), &objectInfo);
-
-                const VkDescriptorSet objectSet = object.descriptors.at(0).set;
-                vkCmdBindDescriptorSets(command,
-                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                        object.pipeline.pipeline_layout,
-                                        0, 1,
-                                        &objectSet,
-                                        0, nullptr);
-
-                VkDeviceSize offsets[1] = {object.geometry.vertices_offset};
-                vkCmdBindVertexBuffers(command,
-                                       0, 1,
-                                       &object.geometry.buffer,
-                                       offsets);
-                vkCmdBindIndexBuffer(command,
-                                     object.geometry.buffer,
-                                     object.geometry.indices_offset,
-                                     VK_INDEX_TYPE_UINT32);
-
-                vkCmdDrawIndexed(command,
-                                 object.geometry.n_of_indices,
-                                 1,
-                                 0,
-                                 0,
-                                 0);
-            }
-
+            vkCmdBeginRenderPass(command, &render_to_target_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+            vkCmdExecuteCommands(command, 1, &shadowCommands[i]);
             vkCmdEndRenderPass(command);
         }
 
@@ -1405,49 +2619,9 @@ private:
         renderpassbegininfo.clearValueCount = clearVals.size();
         renderpassbegininfo.pClearValues = clearVals.data();
 
-        vkCmdBeginRenderPass(command, &renderpassbegininfo, VK_SUBPASS_CONTENTS_INLINE);
-        for (const auto&[name, object]  : loadedObjects) {
-
-            vkCmdBindPipeline(command,
-                              VK_PIPELINE_BIND_POINT_GRAPHICS,
-                              object.pipeline.pipeline);
-
-            glm::vec3 cameraPosition = glm::vec3(glm::vec4(0.0, 0.0, 0.0, 1.0) * activeCamera->modelMatrix());
-            OInfo objectInfo{
-                    activeCamera->getViewMatrix(),
-                    activeCamera->getProjectionMatrix(),
-            };
-            vkCmdPushConstants(command, object.pipeline.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(OInfo),
-                               &objectInfo);
-
-            std::vector<VkDescriptorSet> sets(object.descriptors.size());
-            std::transform(object.descriptors.begin(), object.descriptors.end(), sets.begin(),
-                           [](const auto &o) { return o.second.set; });
-
-            sets.push_back(shadowMapSet);
-            vkCmdBindDescriptorSets(command,
-                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    object.pipeline.pipeline_layout,
-                                    0, sets.size(),
-                                    sets.data(),
-                                    0, nullptr);
-
-            VkDeviceSize offsets[1] = {object.geometry.vertices_offset};
-            vkCmdBindVertexBuffers(command,
-                                   0, 1,
-                                   &object.geometry.buffer,
-                                   offsets);
-            vkCmdBindIndexBuffer(command,
-                                 object.geometry.buffer,
-                                 object.geometry.indices_offset,
-                                 VK_INDEX_TYPE_UINT32);
-
-            vkCmdDrawIndexed(command,
-                             object.geometry.n_of_indices,
-                             1,
-                             0,
-                             0,
-                             0);
+        vkCmdBeginRenderPass(command, &renderpassbegininfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        if (!mainCommands.empty()) {
+            vkCmdExecuteCommands(command, mainCommands.size(), mainCommands.data());
         }
         vkCmdEndRenderPass(command);
 
@@ -1480,7 +2654,8 @@ private:
         VkImageMemoryBarrier imageMemoryBarrier1 = {};
         imageMemoryBarrier1.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
         imageMemoryBarrier1.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-        imageMemoryBarrier1.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        //Offscreen images are never presented, they stay in the layout the readback expects
+        imageMemoryBarrier1.newLayout = m_headless ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
         imageMemoryBarrier1.image = m_swapchain_data.images[frame_data.image_index];
         imageMemoryBarrier1.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
         imageMemoryBarrier1.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
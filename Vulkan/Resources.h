@@ -9,6 +9,9 @@
 #include <numeric>
 #include <glm/ext/matrix_float4x4.hpp>
 #include "Utils.h"
+#include "Allocator.h"
+#include "../SceneGraph/Texture.h"
+#include "../SceneGraph/Bounds.h"
 
 struct DeviceContext{
     VkPhysicalDevice& pdevice;
@@ -16,6 +19,8 @@ struct DeviceContext{
 
     VkQueue graphics;
     uint32_t graphics_index;
+
+    MemoryAllocator& allocator;
 };
 
 struct Buffer {
@@ -34,7 +39,7 @@ struct GeometryBuffer {
     uint32_t vertices_offset;
 
     VkBuffer buffer;
-    VkDeviceMemory memory;
+    Allocation memory;
 
     uint32_t size() const {
         return indices_size + vertices_size;
@@ -44,7 +49,7 @@ struct GeometryBuffer {
 struct Image{
     VkImage image;
     VkImageView imageview;
-    VkDeviceMemory imagememory;
+    Allocation imagememory;
 
     VkSampler sampler;
 };
@@ -52,7 +57,8 @@ struct Image{
 enum UniformType{
     TYPE_BUFFER,
     TYPE_IMAGE,
-    TYPE_CUBEMAP
+    TYPE_CUBEMAP,
+    TYPE_STORAGE_BUFFER
 };
 struct Uniform {
     UniformType type;
@@ -62,6 +68,9 @@ struct Uniform {
     uint32_t count{1};
 
     std::shared_ptr<void> data;
+
+    //How an image is sampled, the renderer shares one VkSampler per distinct state
+    Sampler sampler{};
 };
 
 struct UniformSet{
@@ -83,7 +92,7 @@ struct DescriptorSet{
     std::map<uint32_t, Uniform> uniforms;
 
     VkBuffer uniform_buffer;
-    VkDeviceMemory uniform_memory;
+    Allocation uniform_memory;
 
     std::map<uint32_t, Buffer> buffersForSlot;
     std::map<uint32_t, Image> imagesForSlot;
@@ -99,11 +108,21 @@ struct Pipeline {
     VkExtent2D extent{0, 0};
 };
 
+//The geometry, descriptors and pipeline are shared by every object with the same geometry and material content,
+//the renderer owns them and releases them with the last object that uses them
 struct RenderObject {
     ObjectNode* node;
     GeometryBuffer geometry;
     std::map<uint32_t, DescriptorSet> descriptors;
+    //Index of the model matrix in the transforms buffer
+    uint32_t slot;
     Pipeline pipeline;
+
+    uint64_t geometry_key;
+    uint64_t material_key;
+
+    //Bounds of the geometry in object space
+    Bounds bounds;
 };
 
 struct LightObject{
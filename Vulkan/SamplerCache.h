@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include "Resources.h"
+#include "../SceneGraph/Texture.h"
+
+//Samplers shared by every image with the same sampler state. The device allows a limited number of them
+//(maxSamplerAllocationCount), a scene holds a handful of distinct states however many textures it has.
+//The samplers live until clear, the images using them do not own them
+class SamplerCache {
+private:
+    //Few states, searched in order: the lookup compares every field and never confuses two states
+    std::vector<std::pair<VkSamplerCreateInfo, VkSampler>> mSamplers;
+
+public:
+
+    //Sampler for the full state of info, created the first time the state is asked for. pNext must be null
+    VkSampler get(const DeviceContext& context, const VkSamplerCreateInfo& info) {
+        for (const auto& [state, sampler] : mSamplers) {
+            if (sameState(state, info)) {
+                return sampler;
+            }
+        }
+        VkSampler sampler;
+        if (vkCreateSampler(context.device, &info, nullptr, &sampler) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create a sampler");
+        }
+        mSamplers.emplace_back(info, sampler);
+        return sampler;
+    }
+
+    //Sampler of a texture, the filters and wraps come from the Sampler of its uniform
+    VkSampler get(const DeviceContext& context, const Sampler& sampler) {
+        return get(context, createInfo(sampler));
+    }
+
+    //Destroy every sampler, the device must be done with them
+    void clear(const DeviceContext& context) {
+        for (const auto& [state, sampler] : mSamplers) {
+            vkDestroySampler(context.device, sampler, nullptr);
+        }
+        mSamplers.clear();
+    }
+
+    //Distinct samplers alive
+    size_t size() const {
+        return mSamplers.size();
+    }
+
+    //State of a texture sampler: GL filter and wrap values as in glTF, no mip levels since the images have none
+    static VkSamplerCreateInfo createInfo(const Sampler& sampler) {
+        VkSamplerCreateInfo info{};
+        info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        info.magFilter = filter(sampler.magFilter);
+        info.minFilter = filter(sampler.minFilter);
+        info.addressModeU = addressMode(sampler.wrapS);
+        info.addressModeV = addressMode(sampler.wrapT);
+        info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+
+        info.anisotropyEnable = VK_FALSE;
+        info.maxAnisotropy = 1.0f;
+        info.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK;
+        info.unnormalizedCoordinates = VK_FALSE;
+        info.compareEnable = VK_FALSE;
+        info.compareOp = VK_COMPARE_OP_ALWAYS;
+        info.mipmapMode = mipmapMode(sampler.minFilter);
+        info.mipLodBias = 0.0f;
+        info.minLod = 0.0f;
+        info.maxLod = 0.0f;
+        return info;
+    }
+
+private:
+
+    static bool sameState(const VkSamplerCreateInfo& a, const VkSamplerCreateInfo& b) {
+        return a.flags == b.flags &&
+               a.magFilter == b.magFilter && a.minFilter == b.minFilter && a.mipmapMode == b.mipmapMode &&
+               a.addressModeU == b.addressModeU && a.addressModeV == b.addressModeV &&
+               a.addressModeW == b.addressModeW &&
+               a.mipLodBias == b.mipLodBias &&
+               a.anisotropyEnable == b.anisotropyEnable && a.maxAnisotropy == b.maxAnisotropy &&
+               a.compareEnable == b.compareEnable && a.compareOp == b.compareOp &&
+               a.minLod == b.minLod && a.maxLod == b.maxLod &&
+               a.borderColor == b.borderColor && a.unnormalizedCoordinates == b.unnormalizedCoordinates;
+    }
+
+    static VkFilter filter(const int filter) {
+        switch (filter) {
+            case Sampler::NEAREST:
+            case Sampler::NEAREST_MIPMAP_NEAREST:
+            case Sampler::NEAREST_MIPMAP_LINEAR:
+                return VK_FILTER_NEAREST;
+            default:
+                return VK_FILTER_LINEAR;
+        }
+    }
+
+    static VkSamplerMipmapMode mipmapMode(const int minFilter) {
+        switch (minFilter) {
+            case Sampler::NEAREST_MIPMAP_NEAREST:
+            case Sampler::LINEAR_MIPMAP_NEAREST:
+                return VK_SAMPLER_MIPMAP_MODE_NEAREST;
+            default:
+                return VK_SAMPLER_MIPMAP_MODE_LINEAR;
+        }
+    }
+
+    static VkSamplerAddressMode addressMode(const int wrap) {
+        switch (wrap) {
+            case Sampler::CLAMP_TO_EDGE:
+                return VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+            case Sampler::MIRRORED_REPEAT:
+                return VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT;
+            default:
+                return VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        }
+    }
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <memory>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include "Resources.h"
+#include "VulkanStructs.h"
+#include "../SceneGraph/Hash.h"
+
+//GPU images of the material textures, one per distinct content however many materials use it. The first acquire
+//of a content creates and uploads its image, the release of its last user destroys it
+class TextureCache {
+private:
+    //The pixels an image was uploaded from are compared with the ones of a uniform whose hash matches, only while
+    //they are alive: the cache does not keep them once the materials released them
+    struct Entry {
+        Image image;
+        std::array<uint32_t, 3> size;
+        uint32_t byte_size;
+        std::weak_ptr<void> data;
+        uint32_t users{0};
+    };
+    //Keyed by the content hash, or the next free key when entries with the same hash hold other pixels
+    std::unordered_map<uint64_t, Entry> mEntries;
+    //Key of every image, so that users release the image they were given
+    std::unordered_map<VkImage, uint64_t> mKeys;
+
+    //Content hash of the pixel data already hashed, by address. Copies of a loaded texture share their pixels:
+    //a file used by hundreds of materials is hashed once. The entry is valid while the data is alive
+    struct Hashed {
+        std::weak_ptr<void> data;
+        uint64_t hash;
+    };
+    std::unordered_map<const void*, Hashed> mHashed;
+
+    //Images created and uploaded, over the lifetime of the cache
+    uint32_t mUploads{0};
+
+public:
+
+    //Image holding the data of an image uniform, counted as one more user
+    Image acquire(const DeviceContext& context, const Uniform& uniform) {
+        for (uint64_t key = contentHash(uniform);; ++key) {
+            auto [entry, inserted] = mEntries.try_emplace(key);
+            if (inserted) {
+                //Users with different sampler states share the image, each one sets its own sampler
+                entry->second.image = createImage(context, glm::ivec2(uniform.size[0], uniform.size[1]), VK_NULL_HANDLE);
+                uploadImageData(context, {entry->second.image}, {uniform.data.get()}, {uniform.size}, {uniform.byte_size});
+                entry->second.size = uniform.size;
+                entry->second.byte_size = uniform.byte_size;
+                entry->second.data = uniform.data;
+                mKeys[entry->second.image.image] = key;
+                ++mUploads;
+            } else if (!sameContent(entry->second, uniform)) {
+                continue;
+            }
+            ++entry->second.users;
+            return entry->second.image;
+        }
+    }
+
+    //Drop one user of an image from acquire, the last one destroys it. The device must be done with it
+    void release(const DeviceContext& context, const Image& image) {
+        const auto key = mKeys.find(image.image);
+        if (key == mKeys.end()) {
+            throw std::runtime_error("Released an image the texture cache does not own");
+        }
+        const auto entry = mEntries.find(key->second);
+        if (--entry->second.users == 0) {
+            destroy(context, entry->second.image);
+            mEntries.erase(entry);
+            mKeys.erase(key);
+            std::erase_if(mHashed, [](const auto& hashed) { return hashed.second.data.expired(); });
+        }
+    }
+
+    //Destroy every image whatever its users, the device must be idle
+    void clear(const DeviceContext& context) {
+        for (const auto& [key, entry] : mEntries) {
+            destroy(context, entry.image);
+        }
+        mEntries.clear();
+        mKeys.clear();
+        mHashed.clear();
+    }
+
+    //Distinct images alive
+    size_t size() const {
+        return mEntries.size();
+    }
+
+    uint32_t uploads() const {
+        return mUploads;
+    }
+
+private:
+
+    uint64_t contentHash(const Uniform& uniform) {
+        if (!uniform.data) {
+            throw std::runtime_error("Image uniform without data, it was released before its upload");
+        }
+        const auto hashed = mHashed.find(uniform.data.get());
+        if (hashed != mHashed.end() && !hashed->second.data.expired()) {
+            return hashed->second.hash;
+        }
+
+        uint64_t hash = hashValue(uniform.size);
+        hash = hashValue(uniform.byte_size, hash);
+        hash = hashBytes(uniform.data.get(), uniform.byte_size, hash);
+        mHashed[uniform.data.get()] = {uniform.data, hash};
+        return hash;
+    }
+
+    //Whether the image of entry holds the pixels of uniform. Pixels released since the upload never match
+    static bool sameContent(const Entry& entry, const Uniform& uniform) {
+        if (entry.size != uniform.size || entry.byte_size != uniform.byte_size) {
+            return false;
+        }
+        const auto data = entry.data.lock();
+        if (!data) {
+            return false;
+        }
+        return data == uniform.data || std::memcmp(data.get(), uniform.data.get(), uniform.byte_size) == 0;
+    }
+};
@@ -121,14 +121,13 @@ public:
         throw std::runtime_error("failed to find supported format!");
     }
 
-    static void createImage(const VkPhysicalDevice pdevice, const VkDevice device,
+    //Creates the image only, memory has to be bound by the caller (see MemoryAllocator::allocateForImage)
+    static void createImage(const VkDevice device,
                             VkImage &image,
-                            VkDeviceMemory &imageMemory,
                             const VkExtent2D extent,
                             const VkFormat format,
                             const VkImageTiling tiling,
-                            const VkImageUsageFlags usage,
-                            const VkMemoryPropertyFlags properties) {
+                            const VkImageUsageFlags usage) {
         VkImageCreateInfo imageInfo{};
         imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
         imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -147,22 +146,6 @@ public:
         if (vkCreateImage(device, &imageInfo, nullptr, &image) != VK_SUCCESS) {
             throw std::runtime_error("failed to create image!");
         }
-
-        VkMemoryRequirements memRequirements;
-        vkGetImageMemoryRequirements(device, image, &memRequirements);
-
-        int memory_index = findMemoryTypeIndexForImage(pdevice, device, image, properties);
-
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = memory_index;
-
-        if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate image memory!");
-        }
-
-        vkBindImageMemory(device, image, imageMemory, 0);
     }
 
     static void createImageView(const VkDevice device,
@@ -355,17 +338,6 @@ public:
         return memory_type_index;
     }
 
-    static void copyToMemory(const VkDevice device,
-                             const VkDeviceMemory &memory,
-                             const void *data,
-                             const uint32_t nOfBytes,
-                             const uint32_t offset) {
-        void *shared_memory_begin;
-        vkMapMemory(device, memory, offset, nOfBytes, 0, &shared_memory_begin);
-        memcpy(shared_memory_begin, data, nOfBytes);
-        vkUnmapMemory(device, memory);
-    }
-
     static void createShaderModule(const VkDevice device,
                                    VkShaderModule &module,
                                    const std::vector<char>& shader_code) {
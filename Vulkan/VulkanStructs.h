@@ -10,86 +10,150 @@
 #include <glm/ext/matrix_float4x4.hpp>
 #include "Utils.h"
 #include "Resources.h"
+#include "SamplerCache.h"
 
-GeometryBuffer createBuffer(const DeviceContext& context,
-                            const Geometry& geometry){
-    GeometryBuffer buffer{};
-    buffer.n_of_indices = geometry.indices().size();
-    buffer.n_of_vertices = geometry.vertices().size();
-    buffer.indices_size = geometry.indices().size() * sizeof(uint32_t);
-    buffer.vertices_size = geometry.vertices().size() * sizeof(VertexData);
-    buffer.indices_offset = 0;
-    buffer.vertices_offset = buffer.indices_size;
-
-    Utils::createBuffer(context.device,
-                        buffer.buffer,
-                        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                        VK_SHARING_MODE_EXCLUSIVE,
-                        buffer.size());
-    Utils::allocateDeviceMemory(context.pdevice, context.device,
-                                buffer.buffer,
-                                buffer.memory,
-                                buffer.size(),
-                                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-    vkBindBufferMemory(context.device, buffer.buffer, buffer.memory, 0);
-
-    Utils::copyToMemory(context.device, buffer.memory, geometry.indices().data(),
-            buffer.indices_size, buffer.indices_offset);
-    Utils::copyToMemory(context.device, buffer.memory, geometry.vertices().data(),
-            buffer.vertices_size, buffer.vertices_offset);
-
-    return buffer;
-}
+//Geometry lives in device local memory, all the geometries are copied in with a single
+//staging buffer and a single submit
 std::vector<GeometryBuffer> createBuffers(const DeviceContext& context,
-                                          const std::vector<Geometry>& geometries){
+                                          const std::vector<const Geometry*>& geometries){
     std::vector<GeometryBuffer> objects(geometries.size());
+    if (geometries.empty()) {
+        return objects;
+    }
+
+    //Held until the copy, the geometries may release their data meanwhile
+    std::vector<std::shared_ptr<const GeometryData>> data(geometries.size());
+    uint32_t staging_size = 0;
+    for (int i = 0; i < objects.size(); ++i) {
+        auto& buffer = objects[i];
+        data[i] = geometries[i]->data();
+        buffer.n_of_indices = data[i]->indices.size();
+        buffer.n_of_vertices = data[i]->vertices.size();
+        buffer.indices_size = data[i]->indices.size() * sizeof(uint32_t);
+        buffer.vertices_size = data[i]->vertices.size() * sizeof(VertexData);
+        buffer.indices_offset = 0;
+        buffer.vertices_offset = buffer.indices_size;
+
+        Utils::createBuffer(context.device,
+                            buffer.buffer,
+                            VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                            VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                            VK_SHARING_MODE_EXCLUSIVE,
+                            buffer.size());
+        buffer.memory = context.allocator.allocateForBuffer(buffer.buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+        staging_size += buffer.size();
+    }
+
+    VkBuffer stagingBuffer;
+    Utils::createBuffer(context.device, stagingBuffer, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                        VK_SHARING_MODE_EXCLUSIVE, staging_size);
+    const Allocation stagingMemory = context.allocator.allocateForBuffer(stagingBuffer,
+                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+
+    std::vector<VkBufferCopy> regions(objects.size());
+    uint32_t staging_offset = 0;
+    for (int i = 0; i < objects.size(); ++i) {
+        const auto& buffer = objects[i];
+        memcpy(static_cast<char*>(stagingMemory.mapped) + staging_offset + buffer.indices_offset,
+               data[i]->indices.data(), buffer.indices_size);
+        memcpy(static_cast<char*>(stagingMemory.mapped) + staging_offset + buffer.vertices_offset,
+               data[i]->vertices.data(), buffer.vertices_size);
+
+        regions[i].srcOffset = staging_offset;
+        regions[i].dstOffset = 0;
+        regions[i].size = buffer.size();
+        staging_offset += buffer.size();
+    }
+    context.allocator.flush(stagingMemory);
+
+    VkCommandPool uploadPool{};
+    VkCommandBuffer command;
+
+    VkCommandPoolCreateInfo poolinfo{};
+    poolinfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolinfo.queueFamilyIndex = context.graphics_index;
+    if (vkCreateCommandPool(context.device, &poolinfo, nullptr, &uploadPool) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create command pool");
+    }
+
+    VkCommandBufferAllocateInfo commandBufferAllocateInfo{};
+    commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    commandBufferAllocateInfo.commandPool = uploadPool;
+    commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferAllocateInfo.commandBufferCount = 1;
+    if (vkAllocateCommandBuffers(context.device, &commandBufferAllocateInfo, &command) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to allocate command buffers");
+    }
+
+    VkCommandBufferBeginInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(command, &info);
 
+    std::vector<VkBufferMemoryBarrier> barriers(objects.size());
     for (int i = 0; i < objects.size(); ++i) {
-        objects[i] = createBuffer(context, geometries[i]);
+        vkCmdCopyBuffer(command, stagingBuffer, objects[i].buffer, 1, &regions[i]);
+
+        barriers[i].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barriers[i].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barriers[i].dstAccessMask = VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+        barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barriers[i].buffer = objects[i].buffer;
+        barriers[i].offset = 0;
+        barriers[i].size = VK_WHOLE_SIZE;
     }
 
+    //The copies have to land before the vertex input of any later draw reads them
+    vkCmdPipelineBarrier(command,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                         0,
+                         0, nullptr,
+                         barriers.size(), barriers.data(),
+                         0, nullptr);
+
+    vkEndCommandBuffer(command);
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &command;
+    vkQueueSubmit(context.graphics, 1, &submitInfo, VK_NULL_HANDLE);
+
+    vkQueueWaitIdle(context.graphics);
+
+    vkDestroyCommandPool(context.device, uploadPool, nullptr);
+    vkDestroyBuffer(context.device, stagingBuffer, nullptr);
+    context.allocator.free(stagingMemory);
+
     return objects;
 }
+GeometryBuffer createBuffer(const DeviceContext& context,
+                            const Geometry& geometry){
+    return createBuffers(context, {&geometry}).front();
+}
 
-Image createImage(const DeviceContext& context, glm::ivec2 size){
+//The sampler is shared, from a SamplerCache
+Image createImage(const DeviceContext& context, glm::ivec2 size, VkSampler sampler){
     Image result{};
 
-    Utils::createImage(context.pdevice, context.device,
+    Utils::createImage(context.device,
                        result.image,
-                       result.imagememory,
                        VkExtent2D{
                                static_cast<uint32_t>(size.x),
                                static_cast<uint32_t>(size.y)},
                        VK_FORMAT_R8G8B8A8_SRGB,
                        VK_IMAGE_TILING_OPTIMAL,
-                       VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+                       VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    result.imagememory = context.allocator.allocateForImage(result.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
     Utils::createImageView(context.device,
                            result.imageview,
                            result.image,
                            VK_FORMAT_R8G8B8A8_SRGB,
                            VK_IMAGE_ASPECT_COLOR_BIT);
-
-    VkSamplerCreateInfo info{};
-    info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-    info.magFilter = VK_FILTER_LINEAR;
-    info.minFilter = VK_FILTER_LINEAR;
-    info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-
-    info.anisotropyEnable = VK_FALSE;
-    info.maxAnisotropy = 1.0f;
-    info.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK;
-    info.unnormalizedCoordinates = VK_FALSE;
-    info.compareEnable = VK_FALSE;
-    info.compareOp = VK_COMPARE_OP_ALWAYS;
-    info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-    info.mipLodBias = 0.0f;
-    info.minLod = 0.0f;
-    info.maxLod = 0.0f;
-    vkCreateSampler(context.device, &info, nullptr, &result.sampler);
+    result.sampler = sampler;
 
     return result;
 }
@@ -122,7 +186,7 @@ void uploadImageData(const DeviceContext& context,
     VkMemoryPropertyFlags flags = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 
     std::vector<VkBuffer> stagingBuffers(images.size());
-    std::vector<VkDeviceMemory> stagingBuffersMemory(images.size());
+    std::vector<Allocation> stagingBuffersMemory(images.size());
 
     for(int i = 0; i < images.size(); ++i) {
         const auto &image = images[i];
@@ -135,15 +199,10 @@ void uploadImageData(const DeviceContext& context,
             c = ((unsigned char*)texture)[i];
         }
 
-        uint32_t alloc_size = 0;
         Utils::createBuffer(context.device, stagingBuffers[i], flags, VK_SHARING_MODE_EXCLUSIVE, data_size);
-        alloc_size = Utils::allocateDeviceMemory(context.pdevice, context.device,
-                                    stagingBuffers[i],
-                                    stagingBuffersMemory[i],
-                                    data_size,
-                                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-        Utils::copyToMemory(context.device, stagingBuffersMemory[i], texture, data_size, 0);
-        vkBindBufferMemory(context.device, stagingBuffers[i], stagingBuffersMemory[i], 0);
+        stagingBuffersMemory[i] = context.allocator.allocateForBuffer(stagingBuffers[i],
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+        context.allocator.write(stagingBuffersMemory[i], texture, data_size);
     }
 
     //Register and submit in one pass all the transfer commands
@@ -240,13 +299,14 @@ void uploadImageData(const DeviceContext& context,
     std::for_each(stagingBuffers.begin(), stagingBuffers.end(),
             [&context](const auto& buffer){ vkDestroyBuffer(context.device, buffer, nullptr);});
     std::for_each(stagingBuffersMemory.begin(), stagingBuffersMemory.end(),
-            [&context](const auto& memory){ vkFreeMemory(context.device, memory, nullptr);});
+            [&context](const auto& memory){ context.allocator.free(memory);});
 
     vkDestroyCommandPool(context.device, createResourcesPool, nullptr);
 }
 
 /*
-Image createCubemap(const DeviceContext& context, glm::ivec2 size){
+//The sampler is shared, from a SamplerCache
+Image createCubemap(const DeviceContext& context, glm::ivec2 size, VkSampler sampler){
     Image result{};
 
     Utils::createCubemap(context.pdevice, context.device,
@@ -261,26 +321,7 @@ Image createCubemap(const DeviceContext& context, glm::ivec2 size){
                        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
                        VK_IMAGE_ASPECT_COLOR_BIT,
                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-    VkSamplerCreateInfo info{};
-    info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-    info.magFilter = VK_FILTER_LINEAR;
-    info.minFilter = VK_FILTER_LINEAR;
-    info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
-    info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
-    info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
-
-    info.anisotropyEnable = VK_FALSE;
-    info.maxAnisotropy = 1.0f;
-    info.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK;
-    info.unnormalizedCoordinates = VK_FALSE;
-    info.compareEnable = VK_FALSE;
-    info.compareOp = VK_COMPARE_OP_ALWAYS;
-    info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-    info.mipLodBias = 0.0f;
-    info.minLod = 0.0f;
-    info.maxLod = 0.0f;
-    vkCreateSampler(context.device, &info, nullptr, &result.sampler);
+    result.sampler = sampler;
 
     return result;
 }
@@ -440,6 +481,9 @@ DescriptorLayout createDescriptorLayout(const DeviceContext& context,
         if(uniform.type == TYPE_BUFFER){
             binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
         }
+        if(uniform.type == TYPE_STORAGE_BUFFER){
+            binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        }
         if(uniform.type == TYPE_IMAGE || uniform.type == TYPE_CUBEMAP ){
             binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
         }
@@ -470,6 +514,7 @@ std::vector<std::vector<DescriptorLayout>> createDescriptorLayouts(const DeviceC
 
 //Init the buffers and the images for the descriptor sets
 void initDescriptorSets(const DeviceContext& context,
+        SamplerCache& samplers,
         std::vector<std::vector<DescriptorSet>>& descriptors){
 
     for(int i = 0; i < descriptors.size(); ++i){
@@ -488,18 +533,11 @@ void initDescriptorSets(const DeviceContext& context,
                                     VK_SHARING_MODE_EXCLUSIVE,
                                     total_uniform_size);
 
-                total_uniform_size = Utils::allocateDeviceMemory(context.pdevice, context.device,
-                                                                 descriptor.uniform_buffer, descriptor.uniform_memory,
-                                                                 total_uniform_size,
-                                                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-                vkBindBufferMemory(context.device,
-                                   descriptor.uniform_buffer,
-                                   descriptor.uniform_memory,
-                                   uniform_offset);
+                descriptor.uniform_memory = context.allocator.allocateForBuffer(descriptor.uniform_buffer,
+                                                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
             }else{
                 descriptor.uniform_buffer = VK_NULL_HANDLE;
-                descriptor.uniform_memory = VK_NULL_HANDLE;
+                descriptor.uniform_memory = {};
             }
 
 
@@ -529,7 +567,8 @@ void initDescriptorSets(const DeviceContext& context,
                 }
                 if(uniform.type == TYPE_IMAGE){
 
-                    descriptor.imagesForSlot[slot] = createImage(context, {uniform.size[0], uniform.size[1]});
+                    descriptor.imagesForSlot[slot] = createImage(context, {uniform.size[0], uniform.size[1]},
+                                                                 samplers.get(context, uniform.sampler));
 
                     VkDescriptorImageInfo image_info;
                     image_info.imageView = descriptor.imagesForSlot[slot].imageview;
@@ -579,31 +618,40 @@ Pipeline createPipeline(const DeviceContext& context,
 }
 
 std::vector<Pipeline> createPipelines(const DeviceContext& context,
-                                      const std::vector<Material>& materials,
+                                      const std::vector<const Material*>& materials,
                                       const std::vector<VkDescriptorSetLayout>& layouts,
                                       const VkRenderPass& render_pass,
                                       const VkExtent2D& extent){
     std::vector<Pipeline> pipelines(materials.size());
 
     for(int i = 0; i < pipelines.size(); ++i){
-        pipelines[i] = createPipeline(context, materials[i], layouts, render_pass, extent);
+        pipelines[i] = createPipeline(context, *materials[i], layouts, render_pass, extent);
     }
 
     return pipelines;
 }
 
 
-void updateAllUniforms(const DeviceContext context,
+//Write the buffer uniforms only, for sets whose images are uploaded elsewhere
+void updateBufferUniforms(const DeviceContext context,
         DescriptorSet& descriptor){
 
     for(const auto& [slot, uniform] : descriptor.uniforms){
         if(uniform.type == TYPE_BUFFER){
             if(descriptor.uniform_buffer != VK_NULL_HANDLE){
                 const auto& buffer = descriptor.buffersForSlot.at(slot);
-                Utils::copyToMemory(context.device, descriptor.uniform_memory,
+                context.allocator.write(descriptor.uniform_memory,
                                 descriptor.uniforms.at(slot).data.get(), buffer.size, buffer.offset);
             }
         }
+    }
+}
+
+void updateAllUniforms(const DeviceContext context,
+        DescriptorSet& descriptor){
+
+    updateBufferUniforms(context, descriptor);
+    for(const auto& [slot, uniform] : descriptor.uniforms){
         if(uniform.type == TYPE_IMAGE){
             const auto& image = descriptor.imagesForSlot.at(slot);
             uploadImageData(context, {image}, {descriptor.uniforms.at(slot).data.get()}, {uniform.size}, {uniform.byte_size});
@@ -613,14 +661,14 @@ void updateAllUniforms(const DeviceContext context,
 
 void destroy(const DeviceContext& context, const GeometryBuffer& object){
     vkDestroyBuffer(context.device, object.buffer, nullptr);
-    vkFreeMemory(context.device, object.memory, nullptr);
+    context.allocator.free(object.memory);
 }
 void destroy(const DeviceContext& context, const Image& image){
     vkDestroyImage(context.device, image.image, nullptr);
     vkDestroyImageView(context.device, image.imageview, nullptr);
-    vkDestroySampler(context.device, image.sampler, nullptr);
+    //The sampler belongs to the SamplerCache it came from
 
-    vkFreeMemory(context.device, image.imagememory, nullptr);
+    context.allocator.free(image.imagememory);
 }
 void destroy(const DeviceContext& context, const DescriptorPool& pool){
     vkDestroyDescriptorPool(context.device, pool.pool, nullptr);
@@ -631,7 +679,7 @@ void destroy(const DeviceContext& context, const DescriptorLayout& layout){
 void destroy(const DeviceContext& context, const DescriptorSet& set){
     if(set.uniform_buffer != VK_NULL_HANDLE){
         vkDestroyBuffer(context.device, set.uniform_buffer, nullptr);
-        vkFreeMemory(context.device, set.uniform_memory, nullptr);
+        context.allocator.free(set.uniform_memory);
     }
 
     for (const auto& [slot, image] : set.imagesForSlot) {
@@ -644,10 +692,3 @@ void destroy(const DeviceContext& context, const Pipeline& pipeline){
     vkDestroyPipelineLayout(context.device, pipeline.pipeline_layout, nullptr);
     vkDestroyPipeline(context.device, pipeline.pipeline, nullptr);
 }
-void destroy(const DeviceContext& context, const RenderObject& object) {
-    destroy(context, object.geometry);
-    std::for_each(object.descriptors.begin(), object.descriptors.end(), [&](const auto &descriptor) {
-        destroy(context, descriptor.second);
-    });
-    destroy(context, object.pipeline);
-}
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <string>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "../SceneGraph/TransformKernels.h"
+#include "../SceneGraph/TransformStore.h"
+
+//Scalar glm against the transform kernels on the work of a transform update: composing local matrices,
+//inverting them and propagating world matrices down a hierarchy. The local matrices are composed by the batch
+//kernel as in TransformStore::updateRange, also compared with the per matrix kernel it replaces
+
+template<typename F>
+double measure(const uint32_t repetitions, F&& f) {
+    double best = 1e30;
+    for (uint32_t r = 0; r < repetitions; ++r) {
+        const auto start = std::chrono::steady_clock::now();
+        f();
+        const auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+void report(const std::string& name, const double scalar, const double kernels) {
+    std::cout << name << ": scalar " << scalar << " ms, kernels " << kernels << " ms, x" << scalar / kernels << "\n";
+}
+
+int main() {
+    constexpr uint32_t count = 100000;
+    constexpr uint32_t repetitions = 20;
+
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> values(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> scales(0.5f, 2.0f);
+
+    std::vector<glm::mat4> rotate(count), scale(count), translate(count), out(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        rotate[i] = glm::rotate(glm::mat4(1.0f), values(random), glm::normalize(glm::vec3(values(random), values(random), values(random))));
+        scale[i] = glm::scale(glm::mat4(1.0f), glm::vec3(scales(random), scales(random), scales(random)));
+        translate[i] = glm::translate(glm::mat4(1.0f), glm::vec3(values(random), values(random), values(random)));
+    }
+
+    //Every other node dirty, the batch gathers entries that are not contiguous
+    std::vector<uint32_t> dirty;
+    for (uint32_t i = 0; i < count; i += 2) {
+        dirty.push_back(i);
+    }
+    const double perMatrix = measure(repetitions, [&]() {
+        for (const uint32_t i : dirty) {
+            TransformKernels::multiply(rotate[i], scale[i], translate[i], out[i]);
+        }
+    });
+    const double batch = measure(repetitions, [&]() {
+        TransformKernels::composeBatch(rotate.data(), scale.data(), translate.data(), out.data(),
+                                       dirty.data(), dirty.size());
+    });
+    report("compose",
+           measure(repetitions, [&]() {
+               for (const uint32_t i : dirty) {
+                   out[i] = rotate[i] * scale[i] * translate[i];
+               }
+           }),
+           batch);
+    report("compose, per matrix kernel against batch", perMatrix, batch);
+
+    report("inverse",
+           measure(repetitions, [&]() {
+               for (uint32_t i = 0; i < count; ++i) {
+                   out[i] = glm::inverse(translate[i] * rotate[i]);
+               }
+           }),
+           measure(repetitions, [&]() {
+               for (uint32_t i = 0; i < count; ++i) {
+                   glm::mat4 m;
+                   TransformKernels::multiply(translate[i], rotate[i], m);
+                   out[i] = TransformKernels::affineInverse(m);
+               }
+           }));
+
+    //Every node has a parent before it, a tree four children wide
+    std::vector<uint32_t> parents(count);
+    parents[0] = TransformStore::none;
+    for (uint32_t i = 1; i < count; ++i) {
+        parents[i] = (i - 1) / 4;
+    }
+    report("propagate",
+           measure(repetitions, [&]() {
+               for (uint32_t i = 0; i < count; ++i) {
+                   out[i] = parents[i] == TransformStore::none ? translate[i] : out[parents[i]] * translate[i];
+               }
+           }),
+           measure(repetitions, [&]() {
+               for (uint32_t i = 0; i < count; ++i) {
+                   if (parents[i] == TransformStore::none) {
+                       out[i] = translate[i];
+                   } else {
+                       TransformKernels::multiply(out[parents[i]], translate[i], out[i]);
+                   }
+               }
+           }));
+
+    TransformStore store;
+    std::vector<TransformStore::Handle> handles(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        handles[i] = store.create();
+        store.rotate(handles[i]) = rotate[i];
+        store.translate(handles[i]) = translate[i];
+        if (i > 0) {
+            store.setParent(handles[i], handles[parents[i]]);
+        }
+    }
+    store.update();
+    const double update = measure(repetitions, [&]() {
+        for (const auto handle : handles) {
+            store.markDirty(handle);
+        }
+        store.update();
+    });
+    std::cout << "store update of " << count << " dirty nodes: " << update << " ms\n";
+
+    return 0;
+}
@@ -76,12 +76,14 @@ std::shared_ptr<ObjectNode> loadObjFile(const std::string& name, const std::stri
         };
     }
 
-    Geometry geometry(std::move(indices), std::move(vdata));
+    //Loaded once and never read again after the upload
+    auto geometry = std::make_shared<const Geometry>(std::move(indices), std::move(vdata), Residency::DropAfterUpload);
 
     std::vector<char> vscode = readFile("helmetv.sprv");
     std::vector<char> fscode = readFile("helmetf.sprv");
 
-    Material material(materials[0].name, vscode, fscode);
+    Material material(materials[0].name, std::move(vscode), std::move(fscode));
+    material.setResidency(Residency::DropAfterUpload);
     std::map<uint32_t, Texture2D> textures;
 
     textures.emplace(0, load(materials[0].diffuse_texname));
@@ -90,6 +92,10 @@ std::shared_ptr<ObjectNode> loadObjFile(const std::string& name, const std::stri
     textures.emplace(3, load(materials[0].emissive_texname));
 
     for(const auto& [location, txt] : textures) {
+        //A map the material does not have or that failed to load keeps the default image of its slot
+        if(!txt.data()){
+            continue;
+        }
         const auto uniform = Uniform{
                 .type = TYPE_IMAGE,
                 .size = {static_cast<uint32_t>(txt.size().x), static_cast<uint32_t>(txt.size().y),0},
@@ -101,7 +107,7 @@ std::shared_ptr<ObjectNode> loadObjFile(const std::string& name, const std::stri
         material.uniform(location) = uniform;
     }
 
-    return std::make_shared<ObjectNode>(name, geometry, material);
+    return std::make_shared<ObjectNode>(name, geometry, std::make_shared<const Material>(std::move(material)));
 }
 
 std::shared_ptr<ObjectNode> loadPlane(const std::string& name, const std::string& basedir, const std::string& filename){
@@ -147,21 +153,16 @@ std::shared_ptr<ObjectNode> loadPlane(const std::string& name, const std::string
         vdata[index.vertex_index].texcoord_1 = crd;
     }
 
-    Geometry geometry(std::move(indices), std::move(vdata));
+    //Loaded once and never read again after the upload
+    auto geometry = std::make_shared<const Geometry>(std::move(indices), std::move(vdata), Residency::DropAfterUpload);
 
     std::vector<char> vscode = readFile("planev.sprv");
     std::vector<char> fscode = readFile("planef.sprv");
 
-    Material material("mt", vscode, fscode);
-
-    return std::make_shared<ObjectNode>(name, geometry, material);
-}
+    Material material("mt", std::move(vscode), std::move(fscode));
+    material.setResidency(Residency::DropAfterUpload);
 
-void visitTree(BaseNode* root, Visitor *visitor) {
-    root->accept(visitor);
-    for (const auto& child : root->children()) {
-        visitTree(child.get(), visitor);
-    }
+    return std::make_shared<ObjectNode>(name, geometry, std::make_shared<const Material>(std::move(material)));
 }
 
 int main() {
@@ -170,7 +171,10 @@ int main() {
     const int height = 900;
     const std::string title = "Vulkan";
 
+    //Declared before the root, it has to outlive every node attached to it
+    SceneRegistry registry;
     BaseNode root("root");
+    root.setSceneListener(&registry);
 
     auto camera = std::make_shared<CameraNode>("main camera", true, 45.0f, width, height, 0.1, 1000.0);
     root.addChild(camera);
@@ -204,25 +208,11 @@ int main() {
 
     glm::vec3 rotation(0, 0.0, 0.0);
     glm::vec3 translation({0.0, 0.0, 5.0});
-    root.toUpdate();
+    root.updateTransforms();
     glm::dvec2 start_pos{};
+    bool was_left_pressed = false;
 
-    CollectObjectsVisitor objectsVisitor;
-    visitTree(&root, &objectsVisitor);
-    CollectLightsVisitor lightsVisitor;
-    visitTree(&root, &lightsVisitor);
-
-    FindActiveCameraVisitor cameraVisitor;
-    visitTree(&root, &cameraVisitor);
-
-    std::vector<ObjectNode*> objects = objectsVisitor.collected();
-    std::vector<LightNode*> lights = lightsVisitor.collected();
-
-    const CameraNode* cameraNode = cameraVisitor.collected();
-
-    renderer.setCamera(cameraNode);
-    renderer.setLights(lights);
-    renderer.load(objects);
+    renderer.apply(registry);
 
     while(!window.windowShouldClose()) {
         window.pollEvents();
@@ -267,6 +257,17 @@ int main() {
             rotation.y -= (3.14 / 5.0);
             glfwGetCursorPos(wd, &start_pos.x, &start_pos.y);
         }
+        const bool left_pressed = glfwGetMouseButton(wd, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+        if(left_pressed && !was_left_pressed){
+            glm::dvec2 pos;
+            int w_width, w_height;
+            glfwGetCursorPos(wd, &pos.x, &pos.y);
+            glfwGetWindowSize(wd, &w_width, &w_height);
+
+            const ObjectNode* picked = renderer.pick(glm::vec2(pos.x / w_width, pos.y / w_height));
+            std::cout << "picked: " << (picked ? picked->name() : "nothing") << "\n";
+        }
+        was_left_pressed = left_pressed;
         if(glfwGetKey(wd, GLFW_KEY_SPACE) == GLFW_PRESS){
             rotation = glm::vec4(0.0);
             translation = glm::vec3({0, 0, 5.0});
@@ -276,12 +277,14 @@ int main() {
         model->setRotation(glm::mat4(1.0f));
         model->addRotation(glm::vec3{0.0f, 1.0f, 0.0f}, glm::radians(rotation.y));
         model->addRotation(glm::vec3{1.0f, 0.0f, 0.0f}, glm::radians(rotation.x));
-        root.setToUpdate();
+        root.updateTransforms(renderer.workers());
 
+        renderer.apply(registry);
         renderer.updateUniforms();
         renderer.render();
     }
 
+    const std::vector<ObjectNode*>& objects = registry.objects();
     std::vector<std::string> names;
     names.reserve(objects.size());
     std::transform(objects.begin(), objects.end(), std::back_inserter(names), [](const auto& object){
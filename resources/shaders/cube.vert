@@ -4,11 +4,14 @@ layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
 layout(location = 2) in vec2 inUv;
 
-//Object level data
-layout(set = 0, binding = 0) uniform mmodel{ mat4 model; };
-layout(set = 0, binding = 1) uniform mview{ mat4 view; };
-layout(set = 0, binding = 2) uniform mprojection{ mat4 projection; };
-layout(set = 0, binding = 3) uniform mposition { vec3 cameraPosition; };
+//Frame level data, every instance picks its transform slot and then its model matrix
+layout(set = 0, binding = 0) uniform mcamera{
+    mat4 view;
+    mat4 projection;
+    vec3 cameraPosition;
+};
+layout(std430, set = 0, binding = 1) readonly buffer mtransforms{ mat4 models[]; };
+layout(std430, set = 0, binding = 2) readonly buffer minstances{ uint slots[]; };
 
 layout(location = 0) out vec3 normal;
 layout(location = 1) out vec2 uv;
@@ -16,6 +19,7 @@ layout(location = 2) out vec3 cameraPos;
 layout(location = 3) out vec3 worldPos;
 
 void main() {
+    mat4 model = models[slots[gl_InstanceIndex]];
 
     gl_Position = projection * view * model * vec4(inPosition, 1.0);
 
@@ -6,16 +6,14 @@ layout(location = 2) in vec3 inColor;
 layout(location = 3) in vec2 inTexcoord_1;
 layout(location = 4) in vec2 inTexcoord_2;
 
-//Object level data
-layout(set = 0, binding = 0) uniform mmodel{ mat4 model; };
-layout(set = 0, binding = 1) uniform mview{ mat4 view; };
-layout(set = 0, binding = 2) uniform mprojection{ mat4 projection; };
-layout(set = 0, binding = 3) uniform mposition { vec3 cameraPosition; };
-
-layout(std430, push_constant) uniform pconstants {
+//Frame level data, every instance picks its transform slot and then its model matrix
+layout(set = 0, binding = 0) uniform mcamera{
     mat4 view;
     mat4 projection;
-} constants;
+    vec3 cameraPosition;
+};
+layout(std430, set = 0, binding = 1) readonly buffer mtransforms{ mat4 models[]; };
+layout(std430, set = 0, binding = 2) readonly buffer minstances{ uint slots[]; };
 
 //Material level data
 layout(location = 0) out vec3 outNormal;
@@ -26,13 +24,14 @@ layout(location = 4) out vec3 outPos;
 layout(location = 5) out mat4 outViewMatrix;
 
 void main() {
-    outPos = vec3(constants.view * model * vec4(inPosition, 1.0));
+    mat4 model = models[slots[gl_InstanceIndex]];
+    outPos = vec3(view * model * vec4(inPosition, 1.0));
     outWorldPos = vec3(model * vec4(inPosition, 1.0));
 
     outCameraPos = cameraPosition;
-    outNormal = (transpose(inverse(constants.view * model)) * vec4(inNormal, 0.0)).xyz;
+    outNormal = (transpose(inverse(view * model)) * vec4(inNormal, 0.0)).xyz;
     outUv = inTexcoord_1;
-    outViewMatrix = constants.view;
+    outViewMatrix = view;
 
-    gl_Position = constants.projection * constants.view * model * vec4(inPosition, 1.0);
+    gl_Position = projection * view * model * vec4(inPosition, 1.0);
 }
\ No newline at end of file
@@ -6,12 +6,15 @@ layout(location = 2) in vec3 inColor;
 layout(location = 3) in vec2 inTexcoord_1;
 layout(location = 4) in vec2 inTexcoord_2;
 
-//Object level data
+//Frame level data, every instance picks its transform slot and then its model matrix
 
-layout(set = 0, binding = 0) uniform mmodel{ mat4 model; };
-layout(set = 0, binding = 1) uniform mview{ mat4 view; };
-layout(set = 0, binding = 2) uniform mprojection{ mat4 projection; };
-layout(set = 0, binding = 3) uniform mposition { vec3 cameraPosition; };
+layout(set = 0, binding = 0) uniform mcamera{
+    mat4 view;
+    mat4 projection;
+    vec3 cameraPosition;
+};
+layout(std430, set = 0, binding = 1) readonly buffer mtransforms{ mat4 models[]; };
+layout(std430, set = 0, binding = 2) readonly buffer minstances{ uint slots[]; };
 
 layout(std430, push_constant) uniform pconstants {
     mat4 view;
@@ -19,5 +22,6 @@ layout(std430, push_constant) uniform pconstants {
 } constants;
 
 void main() {
+    mat4 model = models[slots[gl_InstanceIndex]];
     gl_Position = constants.projection * constants.view * model * vec4(inPosition, 1.0);
 }
\ No newline at end of file